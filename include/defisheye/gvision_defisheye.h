@@ -29,8 +29,72 @@
 #include <gst/gst.h>
 
 #include "gvision_base.h"
+#include "remap/gvision_remap.h"
 
-unsigned char* calculate_defisheye(unsigned char *src, unsigned int ssize,
-                                   const struct image_format const *fmt);
+/*
+ * a, b, c and FoV are physical properties of a lens/camera-combination
+ * at a given focus distance. At different focus settings, FoV will
+ * change noticeably, but usually it is fine to reuse a, b, and c even then.
+ */
+#define DEFISHEYE_A (+0.000f) /* affects only the outermost pixels        */
+#define DEFISHEYE_B (+0.076f) /* most cases only require b optimization   */
+#define DEFISHEYE_C (+0.000f) /* uniform correction                       */
+#define DEFISHEYE_D (+1.050f) /* Scaling of the image                     */
+
+/* Angles of the projection models, in degrees */
+#define DEFISHEYE_FOV  180.0f /* lens, across the short side of the frame  */
+#define DEFISHEYE_VIEW 120.0f /* rectilinear output, across the same span  */
+
+/* Magnification of the centre, 1 keeps the whole corrected frame */
+#define DEFISHEYE_ZOOM 1.0f
+
+/* Direction of the view, along the lens axis */
+#define DEFISHEYE_PAN  0.0f
+#define DEFISHEYE_TILT 0.0f
+
+/* Degrees around the lens axis across the width of a panorama */
+#define DEFISHEYE_SPAN 360.0f
+
+/* Degrees the top row of a panorama stays off the lens axis and its back */
+#define DEFISHEYE_TOP_MARGIN 1.0f
+
+void defisheye_default_params(struct defisheye_params* params);
+
+/**
+ * Table rectifying fmt frames into out frames. The short side of the
+ * output spans the short side of the source at zoom 1, a smaller output
+ * is a scaled down one and the table takes several samples per pixel.
+ */
+struct remap_table* prepare_defisheye_table(const struct image_format* fmt,
+                              const struct image_format* out,
+                              const struct defisheye_params* params,
+                              uint32_t mesh_shift, struct worker_pool* pool);
+
+/* Key naming the table of the formats, lens and mesh in the caches */
+void defisheye_table_key(const struct image_format* fmt,
+                         const struct image_format* out,
+                         const struct defisheye_params* params,
+                         uint32_t mesh_shift, char key[REMAP_KEY_SIZE]);
+
+/**
+ * The table from the cache directory, mapped read only and shared with
+ * the other processes using it. Built and stored there when missing.
+ */
+struct remap_table* load_defisheye_table(const struct image_format* fmt,
+                              const struct image_format* out,
+                              const struct defisheye_params* params,
+                              uint32_t mesh_shift, const char* cache_dir,
+                              struct worker_pool* pool);
+
+/**
+ * Rectify the fmt frame src into the out frame dst, scaled on the way when
+ * they differ in size. dst must not overlap src. Tiles of the frame run on
+ * the pool when there is one.
+ */
+void calculate_defisheye(const uint8_t* src, uint8_t* dst,
+                         const struct image_format* fmt,
+                         const struct image_format* out,
+                         const struct remap_table* table,
+                         enum interpolation interp, struct worker_pool* pool);
 
 #endif
@@ -39,6 +39,7 @@ struct TimeNode {
 };
 typedef struct TimeNode TimeNode_t;
 
+/* Shared by the callers, the last release frees it */
 void prepare_duration_hashmaps(size_t initialCapacity);
 
 unsigned long init_reference_point(const char* name, TimeNode_t* tn);
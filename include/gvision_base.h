@@ -27,12 +27,19 @@
 #define __GST_GVISION_PLUGIN_H__
 
 #include <gst/gst.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 G_BEGIN_DECLS
 
 #define FRAME_COUNTER 100U
 
+/* Upper bound of the frames-in-flight property */
+#define GVISION_MAX_FRAMES 64U
+
+/* Default of the cache-size property, in MiB */
+#define GVISION_CACHE_SIZE 128U
+
 enum pixels_type {
     PIXEL_YV12,
     PIXEL_RGB
@@ -46,6 +53,118 @@ enum colors_type {
     COLOR_HSV
 };
 
+/**
+ * Processing applied by the element
+ */
+enum gvision_mode {
+    MODE_EQUALIZE,
+    MODE_AUTO_LEVELS,
+    MODE_DEFISHEYE,
+    MODE_REMAP
+};
+
+/**
+ * White balance estimated from the per channel histograms of RGB frames
+ */
+enum white_balance {
+    WB_NONE,
+    WB_GRAY_WORLD,
+    WB_WHITE_PATCH
+};
+
+/**
+ * Sampling of the source image by the remap kernel
+ */
+enum interpolation {
+    INTERP_NEAREST,
+    INTERP_BILINEAR,
+    INTERP_BICUBIC
+};
+
+/**
+ * Lens model of defisheye, the barrel polynomial or a fisheye projection
+ */
+enum lens_model {
+    LENS_POLYNOMIAL,
+    LENS_EQUIDISTANT,
+    LENS_EQUISOLID,
+    LENS_STEREOGRAPHIC,
+    LENS_ORTHOGRAPHIC
+};
+
+/**
+ * Output of defisheye, a rectilinear view or a panorama unwrapped around
+ * the lens axis
+ */
+enum projection_type {
+    PROJECTION_RECTILINEAR,
+    PROJECTION_CYLINDRICAL,
+    PROJECTION_EQUIRECTANGULAR
+};
+
+/**
+ * Storage of the remap table, a position per pixel or a coarse mesh
+ */
+enum map_type {
+    MAP_FULL,
+    MAP_MESH
+};
+
+/**
+ * Scheduling of the worker threads
+ */
+enum sched_policy {
+    POLICY_OTHER,
+    POLICY_FIFO
+};
+
+/**
+ * Worker pool setup. Priority is the nice value for POLICY_OTHER and the
+ * real-time priority for POLICY_FIFO.
+ */
+struct pool_config {
+    /* Threads including the submitting one, zero for one per CPU */
+    uint32_t          threads;
+    /* CPUs to pin the workers to, e.g. "0-3,8", NULL for no pinning */
+    char*             cpus;
+    /* NUMA node to take the CPUs from when cpus is not set, -1 for none */
+    int32_t           numa_node;
+    enum sched_policy policy;
+    int32_t           priority;
+    /* Join the process-wide pool instead of starting own threads */
+    bool              shared;
+    /* Jobs of higher priority streams are picked first by shared workers */
+    int32_t           stream_priority;
+    /* Tune threads and band sizes of every stage online */
+    bool              tune;
+};
+
+/**
+ * Lens correction coefficients, see gvision_defisheye.c
+ */
+struct defisheye_params {
+    enum lens_model model;
+    /* Polynomial model */
+    float a;
+    float b;
+    float c;
+    float d;
+    /* Projection models, degrees across the image circle of the lens and
+     * across the same circle of the rectilinear output */
+    float fov;
+    float view;
+    /* Magnification of the output, 1 for the whole corrected frame */
+    float zoom;
+    /* Direction of the view in degrees, around the lens axis and away from
+     * it, a virtual camera through the projection models */
+    float pan;
+    float tilt;
+    /* Panoramas take the degrees around the axis across their width, from
+     * the edge of the image circle, less the tilt, towards the axis */
+    enum projection_type projection;
+    float span;
+};
+
 /**
  * Buffer format
  */
@@ -70,6 +189,47 @@ struct image_format {
 #define GST_IS_PLUGIN_TEMPLATE_CLASS(klass) \
   (G_TYPE_CHECK_CLASS_TYPE((klass),GVISION_BASE_TYPE))
 
+struct levels_state;
+struct worker_pool;
+struct pool_task;
+struct remap_table;
+struct _GstGVisionPlugin;
+
+/**
+ * Frame processed on the worker pool, queued in arrival order
+ */
+struct gvision_frame {
+  struct _GstGVisionPlugin *filter;
+  /* Properties of the frame, the job may run on a worker */
+  enum gvision_mode mode;
+  enum white_balance balance;
+  enum interpolation interp;
+  GstBuffer *buffer;
+  GstMapInfo map;
+  /* Out of place modes only, pushed instead of buffer */
+  GstBuffer *output;
+  GstMapInfo out_map;
+  /* NULL when an in place frame could not be mapped, it passes through */
+  struct pool_task *task;
+  /* Reference to the table of the frame, dropped when it leaves */
+  struct remap_table *remap;
+};
+
+/**
+ * Remap table built on a worker for a new lens while the frames go on
+ * with the current one
+ */
+struct gvision_rebuild {
+  struct image_format format;
+  struct image_format out_format;
+  struct defisheye_params lens;
+  uint32_t mesh_shift;
+  const gchar *cache_dir;
+  struct remap_table *table;
+  /* NULL when no rebuild runs */
+  struct pool_task *task;
+};
+
 typedef struct _GstGVisionPlugin      GstGVisionPlugin;
 typedef struct _GstGVisionPluginClass GstGVisionPluginClass;
 
@@ -80,6 +240,41 @@ struct _GstGVisionPlugin
   GstPad *sinkpad, *srcpad;
 
   gboolean silent;
+
+  struct image_format format;
+  /* Format of the pushed frames, the input one but for the scaling modes */
+  struct image_format out_format;
+  enum gvision_mode mode;
+  enum white_balance balance;
+  struct levels_state* levels;
+  struct pool_config pool_config;
+  struct worker_pool* pool;
+
+  /* Built for the current format on the first defisheye frame */
+  struct defisheye_params lens;
+  /* Lens the current table was built for */
+  struct defisheye_params remap_lens;
+  enum interpolation interp;
+  enum map_type map_type;
+  struct remap_table* remap;
+  /* Directory of the stored tables, NULL to build them every time */
+  gchar* cache_dir;
+  /* Maps of remap mode, set under the object lock */
+  gchar* map_file;
+  /* Map file the current table was loaded from, NULL for a lens table */
+  gchar* remap_file;
+  struct gvision_rebuild rebuild;
+  /* Recently used tables, to switch back to a lens without a rebuild */
+  struct remap_cache* tables;
+  guint cache_size;
+  /* Output buffers of the out of place modes */
+  GstBufferPool* out_pool;
+
+  /* Reorder window of frame level processing, frame_head is the oldest */
+  guint frames_in_flight;
+  struct gvision_frame* frames;
+  guint frame_head;
+  guint frame_count;
 };
 
 struct _GstGVisionPluginClass
@@ -89,6 +284,37 @@ struct _GstGVisionPluginClass
 
 GType gst_gvision_plugin_get_type (void);
 
+/* Enum properties shared by the elements of the plugin */
+#define GST_TYPE_GVISION_INTERPOLATION (gst_gvision_interpolation_get_type())
+#define GST_TYPE_GVISION_LENS_MODEL (gst_gvision_lens_model_get_type())
+#define GST_TYPE_GVISION_MAP_TYPE (gst_gvision_map_type_get_type())
+
+GType gst_gvision_interpolation_get_type (void);
+GType gst_gvision_lens_model_get_type (void);
+GType gst_gvision_map_type_get_type (void);
+
+/* Frame format of fixed caps */
+void gvision_get_video_caps(struct image_format *fmt, GstCaps *caps);
+
+/* Bytes of a frame in the plane layout of the kernels */
+gsize gvision_frame_size(const struct image_format *fmt);
+
+/* The caps with any frame size, defisheye scales to the size downstream */
+GstCaps *gvision_any_size(GstCaps *caps);
+
+/**
+ * Output caps of the fixed input caps: its format and rate in the size
+ * downstream of the pad takes, the input size when any will do. NULL when
+ * downstream takes none of them.
+ */
+GstCaps *gvision_output_caps(GstPad *srcpad, GstCaps *caps);
+
+/**
+ * FALSE for a GST_PARAM_MUTABLE_READY property of an element past READY,
+ * the streaming thread may be using what the property sets up
+ */
+gboolean gvision_property_mutable(GstElement *element, GParamSpec *pspec);
+
 G_END_DECLS
 
 #endif /* __GST_GVISION_PLUGIN_H__ */
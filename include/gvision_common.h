@@ -38,6 +38,10 @@
 #define clamp(x, low, high)({x > high ? high : (x < low ? low : x);})
 #endif
 
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64U
+#endif
+
 #define S1(x) #x
 #define S2(x) S1(x)
 #define HOOK_ID __FILE__ ":" S2(__LINE__)
@@ -27,36 +27,199 @@
 #define __GVISION_MULTITHREAD_H__
 
 #include "gvision_base.h"
+#include "gvision_common.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define POOL_SPIN_MIN 64U
+#define POOL_SPIN_MAX 16384U
+
+/* Chunks per thread, smaller chunks even out the load */
+#define POOL_CHUNKS_PER_THREAD 4U
+
+/* Tile edge of automatic tiles when tuning is off */
+#define POOL_TILE_SIZE 64U
+/* Smallest tile edge tried by the tuner */
+#define POOL_TILE_MIN 32U
+
+/* Stages tuned at the same time by one pool handle */
+#define POOL_TUNE_STAGES 8U
+/* Band sizes tried for every thread count */
+#define POOL_TUNE_SPLITS 3U
+#define POOL_TUNE_CHOICES 24U
+/* Calls timed per choice while exploring */
+#define POOL_TUNE_SAMPLES 3U
+/**
+ * Calls with the chosen setup before exploring again the choices one
+ * thread step and one split away from it
+ */
+#define POOL_TUNE_PERIOD 1000U
+/* Explore again when the chosen setup got that much slower */
+#define POOL_TUNE_SLOWDOWN 1.5
+#define POOL_TUNE_SMOOTHING 0.125
 
 enum thread_state {
     STANDBY,
     WORKING
 };
 
+/**
+ * Job function, called with disjoint [begin, end) sub-ranges of the job
+ * range. Worker is the index of the calling thread, 0 .. pool_size() - 1,
+ * the thread which submitted the job runs as the last one.
+ */
+typedef void (*job_func_t)(void* arg, uint32_t begin, uint32_t end,
+                           unsigned int worker);
+
+/**
+ * Job descriptor, the range is split in chunks of grain items. Every
+ * thread starts on its own contiguous run of chunks and steals chunks from
+ * the end of the other runs once it is done. Workers limits the threads
+ * of the job, including the submitting one, zero for all of them.
+ */
+struct pool_job {
+    job_func_t func;
+    void* arg;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t grain;
+    uint32_t workers;
+};
+
+struct worker_pool;
+struct pool_core;
+struct pool_task;
+
+/**
+ * Part of an image handed to a band function
+ */
+struct image_band {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/**
+ * Band function, scratch is the private area of the calling thread
+ */
+typedef void (*band_func_t)(void* arg, const struct image_band* const band,
+                            void* scratch);
+
+/**
+ * Reduce function, called on the submitting thread for the scratch area
+ * of every thread once all bands are done
+ */
+typedef void (*reduce_func_t)(void* arg, void* scratch);
+
+/**
+ * Image job descriptor, scratch areas start zeroed and are cache line
+ * aligned. Both scratch_size and reduce are optional. The stage tells the
+ * call sites of one band function apart, each one is tuned on its own.
+ */
+struct band_job {
+    band_func_t func;
+    void* arg;
+    size_t scratch_size;
+    reduce_func_t reduce;
+    unsigned int stage;
+};
+
+/**
+ * Time a worker spent on jobs, blocked without work and spinning for
+ * work, in nanoseconds, and the chunks it ran, stolen ones included
+ */
+struct worker_stats {
+    uint64_t busy;
+    uint64_t idle;
+    uint64_t wait;
+    uint64_t tasks;
+    uint64_t chunks;
+    uint64_t steals;
+};
+
+/**
+ * Context of one worker, on its own cache lines so that the counters a
+ * worker updates never share a line with another worker
+ */
 struct thread_context {
     int id;
-    int nproc;
-    const uint8_t* offset;
-    uint16_t* results;
-    struct image_format format;
+    struct pool_core* core;
+    pthread_t thread;
     enum thread_state state;
+    unsigned int spin;
 #ifdef CALC_THREAD_DURATION
-    double sum;
-    unsigned int counter;
-    struct timeval start;
-    struct timeval stop;
+    /* Written by the worker only, read by pool_stats() */
+    struct worker_stats stats;
 #endif
-};
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 typedef struct thread_context tcontext_t;
 
-void prepare_histogram_pdf_mt(void);
+/* Defaults: one thread per online CPU, no pinning, normal priority */
+void pool_default_config(struct pool_config* const config);
+
+/**
+ * Start a pool of persistent workers, NULL config for the defaults.
+ * Pinned workers get one CPU each, in the order of the list, the last CPU
+ * of the list is left to the submitting thread. With config->shared the
+ * handle joins the process-wide pool instead, which is set up from the
+ * config of its first user.
+ */
+struct worker_pool* pool_create(const struct pool_config* config);
+
+/* Number of threads a job can run on, including the submitting one */
+unsigned int pool_size(const struct worker_pool* const pool);
+
+/* Run the job to completion, the calling thread takes part in it */
+void pool_run(struct worker_pool* const pool, const struct pool_job* const job);
 
-void calc_histogram_pdf_mt(const uint8_t* const buf,
-                           const struct image_format* const fmt,
-                           uint16_t* const hresult);
+/**
+ * Queue the job and return at once. The calling thread must not be one of
+ * the workers. Every submitted task is released with pool_wait(), which
+ * may run remaining chunks on the calling thread.
+ */
+struct pool_task* pool_submit(struct worker_pool* const pool,
+                              const struct pool_job* const job);
+
+/* All chunks of the task are done, pool_wait() will not block */
+bool pool_ready(const struct pool_task* const task);
+
+void pool_wait(struct worker_pool* const pool, struct pool_task* task);
+
+/**
+ * Copy the counters of up to count workers, returns the number of
+ * workers. The last entry sums up the submitting threads, their busy time
+ * is not measured, wait is the time they waited for workers. All zero
+ * without CALC_THREAD_DURATION.
+ */
+unsigned int pool_stats(const struct worker_pool* const pool,
+                        struct worker_stats* const stats, unsigned int count);
 
-void release_histogram_pdf_mt(void);
+/* Release the handle, the threads stop with the last user */
+void pool_destroy(struct worker_pool* pool);
+
+/**
+ * Run the job over bands of full lines, rows lines each. With zero rows a
+ * tuning pool picks the thread count and band height of the stage from
+ * the times of earlier calls, otherwise the band height follows from the
+ * pool size. Without a pool the whole image is one band processed by the
+ * calling thread. A pool handle is used by one thread at a time.
+ */
+void parallel_for_rows(struct worker_pool* const pool,
+                       const struct image_format* const fmt,
+                       const struct band_job* const job, uint32_t rows);
+
+/**
+ * Run the job over tiles of the image. Tiles are numbered in row-major
+ * order, so each thread starts on a horizontal strip of adjacent tiles.
+ * A zero tile size is picked by the tuner, as the band height of
+ * parallel_for_rows(), or is POOL_TILE_SIZE.
+ */
+void parallel_for_tiles(struct worker_pool* const pool,
+                        const struct image_format* const fmt,
+                        const struct band_job* const job,
+                        uint32_t tile_width, uint32_t tile_height);
 
 #endif
@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2017 Atanas Filipov <it.feel.filipov@gmail.com>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __GST_GVISION_PTZ_H__
+#define __GST_GVISION_PTZ_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstflowcombiner.h>
+
+#include "gvision_base.h"
+
+G_BEGIN_DECLS
+
+#define GVISION_PTZ_TYPE \
+  (gst_gvision_ptz_get_type())
+#define GST_GVISION_PTZ(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GVISION_PTZ_TYPE,GstGVisionPtz))
+#define GST_GVISION_PTZ_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GVISION_PTZ_TYPE,GstGVisionPtzClass))
+
+#define GVISION_PTZ_PAD_TYPE \
+  (gst_gvision_ptz_pad_get_type())
+#define GST_GVISION_PTZ_PAD(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GVISION_PTZ_PAD_TYPE,GstGVisionPtzPad))
+
+struct remap_table;
+struct remap_cache;
+
+typedef struct _GstGVisionPtzPad      GstGVisionPtzPad;
+typedef struct _GstGVisionPtzPadClass GstGVisionPtzPadClass;
+
+/**
+ * Request src pad, one virtual camera turned and zoomed on its own
+ */
+struct _GstGVisionPtzPad
+{
+  GstPad pad;
+
+  /* Set under the object lock of the pad */
+  gfloat pan;
+  gfloat tilt;
+  gfloat zoom;
+
+  /* Caps are pushed with the next frame after a new input or reconfigure */
+  gboolean reconfigure;
+  struct image_format format;
+  /* Lens the current table was built for */
+  struct defisheye_params remap_lens;
+  struct remap_table *remap;
+  GstBufferPool *out_pool;
+
+  /* Buffer of the frame in progress */
+  GstBuffer *output;
+  GstMapInfo out_map;
+};
+
+struct _GstGVisionPtzPadClass
+{
+  GstPadClass parent_class;
+};
+
+typedef struct _GstGVisionPtz      GstGVisionPtz;
+typedef struct _GstGVisionPtzClass GstGVisionPtzClass;
+
+/**
+ * Several views of one fisheye input, all of them gathered from the same
+ * mapped frame in one pass over the worker pool
+ */
+struct _GstGVisionPtz
+{
+  GstElement element;
+
+  GstPad *sinkpad;
+
+  struct image_format format;
+  /* Lens shared by the views, their direction and zoom are left out */
+  struct defisheye_params lens;
+  enum interpolation interp;
+  enum map_type map_type;
+  struct pool_config pool_config;
+  struct worker_pool *pool;
+  /* Tables of every view, a view going back to a preset needs no build */
+  struct remap_cache *tables;
+  guint cache_size;
+
+  /* Flow of the src pads, in the streaming thread only */
+  GstFlowCombiner *flow;
+  guint next_pad;
+};
+
+struct _GstGVisionPtzClass
+{
+  GstElementClass parent_class;
+};
+
+GType gst_gvision_ptz_get_type (void);
+GType gst_gvision_ptz_pad_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_GVISION_PTZ_H__ */
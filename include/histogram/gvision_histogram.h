@@ -28,8 +28,10 @@
 
 #include <gst/gst.h>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "gvision_base.h"
 
@@ -37,17 +39,96 @@
 #define HIST_COUNT      8
 #define HIST_STEPS      1
 
-typedef uint16_t* histo_ptr_t;
+/* Auto-levels percentiles, histogram subsampling and endpoint smoothing */
+#define LEVELS_LOW_PERCENT   1U
+#define LEVELS_HIGH_PERCENT  99U
+#define LEVELS_SUBSAMPLE     4U
+#define LEVELS_SMOOTHING     0.125f
 
-void prepare_histogram_array(unsigned int count);
+/* White-patch percentile and limits of the white balance gains */
+#define BALANCE_WHITE_PERCENT 99U
+#define BALANCE_MIN_GAIN      0.25f
+#define BALANCE_MAX_GAIN      4.0f
+#define BALANCE_SMOOTHING     0.125f
+
+struct worker_pool;
+
+/**
+ * Histograms of the R, G and B channels
+ */
+struct channel_histograms {
+    uint32_t red[MAX_HISTO_SIZE];
+    uint32_t green[MAX_HISTO_SIZE];
+    uint32_t blue[MAX_HISTO_SIZE];
+};
+
+/**
+ * Contrast stretch endpoints and white balance gains, smoothed over the
+ * frames of one stream
+ */
+struct levels_state {
+    pthread_mutex_t lock;
+    float low;
+    float high;
+    bool  valid;
+    /* R, G and B gains of the earlier frames */
+    float gains[3];
+    bool  balanced;
+};
 
 void calc_histogram_pdf(const uint8_t* const buf, const struct image_format* const fmt,
-                        uint16_t* hresult);
+                        uint32_t* hresult);
+
+/**
+ * Same as calc_histogram_pdf(), but samples only every step-th pixel of
+ * every step-th line
+ */
+void calc_histogram_pdf_step(const uint8_t* const buf,
+                             const struct image_format* const fmt,
+                             uint32_t* hresult, unsigned int step);
+
+/**
+ * Same as calc_histogram_pdf_step(), and accumulates the R, G and B
+ * histograms of RGB frames in the same pass when channels is not NULL
+ */
+void calc_histogram_pdf_channels(const uint8_t* const buf,
+                                 const struct image_format* const fmt,
+                                 uint32_t* hresult,
+                                 struct channel_histograms* channels,
+                                 unsigned int step);
+
+/**
+ * Histogram of the frame calculated in bands on the pool, or by the calling
+ * thread when there is no pool
+ */
+void calc_histogram_pdf_mt(const uint8_t* const buf,
+                           const struct image_format* const fmt,
+                           uint32_t* hresult,
+                           struct channel_histograms* channels,
+                           unsigned int step, struct worker_pool* const pool);
 
-void equalize_histogram(uint8_t* buf, const struct image_format* const fmt);
+/**
+ * Both passes over the frame run on the pool when one is given. The white
+ * balance gains of the frame come from the earlier frames of the state.
+ */
+void equalize_histogram(uint8_t* buf, const struct image_format* const fmt,
+                        struct levels_state* const state,
+                        enum white_balance balance,
+                        struct worker_pool* const pool);
+
+struct levels_state* prepare_levels_state(void);
+
+/**
+ * Linear contrast stretch between the LEVELS_LOW_PERCENT and
+ * LEVELS_HIGH_PERCENT percentiles of a subsampled histogram
+ */
+void autolevels_histogram(uint8_t* buf, const struct image_format* const fmt,
+                          struct levels_state* const state,
+                          enum white_balance balance,
+                          struct worker_pool* const pool);
 
-void plot_histograms(FILE* const fh, const uint16_t* const histogram, uint16_t hsize);
+void release_levels_state(struct levels_state* state);
 
-void release_histogram_array(unsigned int count);
+void plot_histograms(FILE* const fh, const uint32_t* const histogram, uint16_t hsize);
 
 #endif
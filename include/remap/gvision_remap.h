@@ -0,0 +1,228 @@
+/**
+ * Copyright (c) 2017 Atanas Filipov <it.feel.filipov@gmail.com>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __GVISION_REMAP_H__
+#define __GVISION_REMAP_H__
+
+#include <stdint.h>
+
+#include "gvision_base.h"
+#include "gvision_multithread.h"
+
+/* Fractional bits of the source positions */
+#define REMAP_FRAC_BITS 8U
+#define REMAP_ONE       (1 << REMAP_FRAC_BITS)
+
+/* Fractional bits of the bicubic weights */
+#define REMAP_CUBIC_BITS 10U
+
+/* Output tiles, one cache line of luma wide, walked in row major order */
+#define REMAP_TILE_WIDTH  64U
+#define REMAP_TILE_HEIGHT 16U
+/* Source lines of the row that many rows ahead are prefetched */
+#define REMAP_PREFETCH_ROWS 2U
+/* Source rows prefetched at most per output row */
+#define REMAP_PREFETCH_SPAN 8U
+/* Planes from that size on bypass the caches on store */
+#define REMAP_STREAM_BYTES (512U * 1024U)
+/* Grid spacing of mesh tables, 1 << REMAP_MESH_SHIFT pixels, at most 5 */
+#define REMAP_MESH_SHIFT 4U
+/* Positions per destination pixel of shrinking tables, at most
+ * 1 << REMAP_MAX_SAMPLE_SHIFT along each axis */
+#define REMAP_MAX_SAMPLE_SHIFT 2U
+
+/* Bytes per pixel of the widest format */
+#define REMAP_MAX_BPP 4U
+
+/* Table files, the key names what the table was built from */
+#define REMAP_FILE_MAGIC "GVREMAP3"
+#define REMAP_KEY_SIZE   384U
+
+/**
+ * Source position of one destination pixel, fixed point. The fractional
+ * parts are the interpolation weights.
+ */
+struct remap_coord {
+    int32_t x;
+    int32_t y;
+};
+
+/**
+ * Source positions of the destination pixels, row major. Positions are
+ * clamped to the source plane when the table is built, so the per frame
+ * pass is a plain gather. A mesh holds the positions of every
+ * 1 << mesh_shift-th pixel only, with one more entry past the last pixel of
+ * every row and column, the positions in between are interpolated.
+ * Tables shrinking the source hold 1 << sample_shift positions per
+ * destination pixel along each axis, spread evenly over its area, and the
+ * gather averages them.
+ * Tables of 4:2:0 frames may carry a table of the chroma planes. Tables
+ * are reference counted, the last release_remap_table() frees them.
+ */
+struct remap_table {
+    /* Destination plane */
+    uint32_t width;
+    uint32_t height;
+    /* Source plane */
+    uint32_t src_width;
+    uint32_t src_height;
+    /* Zero for an entry per pixel */
+    uint32_t mesh_shift;
+    /* Zero for a position per pixel */
+    uint32_t sample_shift;
+    /* Entries per row and rows of entries */
+    uint32_t cols;
+    uint32_t rows;
+    struct remap_coord* coords;
+    /* Half resolution table of the chroma planes, or NULL */
+    struct remap_table* chroma;
+    /* File mapping of the entries, NULL when they are allocated. Only the
+     * table which mapped the file unmaps it, mapping_size is 0 in the
+     * chroma table sharing it */
+    void* mapping;
+    size_t mapping_size;
+    unsigned int refs;
+};
+
+/**
+ * One output of remap_frames(), the out frame dst through the table
+ */
+struct remap_view {
+    const struct remap_table* table;
+    uint8_t* dst;
+    const struct image_format* out;
+};
+
+/**
+ * Built tables by key, the least recently used ones are dropped once they
+ * take more than the limit. Tables in use stay alive through their
+ * references.
+ */
+struct remap_cache;
+
+/**
+ * Source position (sx, sy) of the destination point (x, y), in pixels.
+ * Samples of a pixel fall at fractional points around its centre.
+ */
+typedef void (*remap_func_t)(void* arg, float x, float y, float* sx,
+                             float* sy);
+
+struct remap_table* prepare_remap_table(uint32_t width, uint32_t height,
+                                        uint32_t src_width,
+                                        uint32_t src_height,
+                                        uint32_t mesh_shift,
+                                        uint32_t sample_shift);
+
+/**
+ * Add a chroma table to a luma table of planar 4:2:0 frames. It is built
+ * along with the luma entries, at the centres of the chroma samples.
+ * Without one, chroma takes the luma entry of every other pixel and row,
+ * sampled tables need one.
+ */
+void prepare_remap_chroma(struct remap_table* table);
+
+/* Evaluate func for every entry, on the pool when there is one */
+void build_remap_table(struct remap_table* table, remap_func_t func,
+                       void* arg, struct worker_pool* pool);
+
+/**
+ * Gather the fmt frame src through the table into the out frame dst,
+ * output tiles in row major order with the source lines of the next rows
+ * prefetched. The tiles are spread over the pool when there is one. dst
+ * must not overlap src.
+ */
+void remap_frame(const struct remap_table* table, const uint8_t* src,
+                 uint8_t* dst, const struct image_format* fmt,
+                 const struct image_format* out, enum interpolation interp,
+                 struct worker_pool* pool);
+
+/**
+ * Gather several views of the same source frame in one pass. The tiles of
+ * every view go to the pool together, with one wait for all of them.
+ */
+void remap_frames(const struct remap_view* views, unsigned int count,
+                  const uint8_t* src, const struct image_format* fmt,
+                  enum interpolation interp, struct worker_pool* pool);
+
+/* Source position of the sample (x, y), the pixel itself when unsampled */
+void remap_lookup(const struct remap_table* table, uint32_t x, uint32_t y,
+                  struct remap_coord* coord);
+
+/* Bytes held by the entries of the table and its chroma table */
+size_t remap_table_size(const struct remap_table* table);
+
+/**
+ * Map a table stored by store_remap_table() read only, shared with every
+ * process mapping the same file. NULL when the file is missing, was stored
+ * for another key or does not hold a valid table.
+ */
+struct remap_table* load_remap_table(const char* path, const char* key);
+
+/**
+ * Write the table and its chroma table to path, through a temporary file
+ * renamed over it so readers never map a partial table
+ */
+bool store_remap_table(const struct remap_table* table, const char* path,
+                       const char* key);
+
+/**
+ * Table of OpenCV style maps stored in a file, the mapx plane then the
+ * mapy plane of out frame size in 32 bit floats of the host byte order,
+ * the fmt source position of every output pixel. The file is mapped and
+ * converted once, positions outside the source take its edge. NULL when
+ * the file does not hold two planes of that size.
+ */
+struct remap_table* load_remap_maps(const char* path,
+                                    const struct image_format* fmt,
+                                    const struct image_format* out,
+                                    uint32_t mesh_shift,
+                                    struct worker_pool* pool);
+
+/* Another reference to the table, for another user */
+struct remap_table* remap_table_ref(struct remap_table* table);
+
+/* Drop a reference, the table goes with the last one */
+void release_remap_table(struct remap_table* table);
+
+/* Cache of at most limit bytes of tables, nothing is kept with 0 */
+struct remap_cache* prepare_remap_cache(size_t limit);
+
+/* Change the limit, tables above it are dropped at once */
+void remap_cache_limit(struct remap_cache* cache, size_t limit);
+
+/* A reference to the table of the key, NULL when it is not cached */
+struct remap_table* remap_cache_get(struct remap_cache* cache,
+                                    const char* key);
+
+/* Keep a reference to the table under the key */
+void remap_cache_put(struct remap_cache* cache, const char* key,
+                     struct remap_table* table);
+
+/* Bytes of the cached tables */
+size_t remap_cache_size(struct remap_cache* cache);
+
+void release_remap_cache(struct remap_cache* cache);
+
+#endif
@@ -25,9 +25,15 @@
 
 #include "defisheye/gvision_defisheye.h"
 #include "gvision_common.h"
+#include "duration/gvision_duration.h"
+#include "hashmap/gvision_hash.h"
 
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <float.h>
 #include <math.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <assert.h>
 
@@ -62,151 +68,369 @@
  * inner parts pincushion, you should use negative a and positive b values.
  * If you do not want to scale the image, you should set d so that a+b+c+d = 1.
  */
-unsigned char* calculate_defisheye(unsigned char *src, unsigned int ssize,
-                                   const struct image_format const *fmt)
-{assert(src && ssize && fmt);
-
-    /* pointers to source pixels */
-    const unsigned char* iYptr;
-    const unsigned char* iUptr;
-    const unsigned char* iVptr;
-
-    /* pointers to destination pixels */
-    unsigned char* oYptr;
-    unsigned char* oUptr;
-    unsigned char* oVptr;
-
-    /* source pixel offset */
-    unsigned int soffs;
-    /* destination pixel offset */
-    unsigned int doffs;
-
-    /* Allocate output srcfer */
-    GstBuffer *osrc = gst_buffer_new_allocate(NULL, ssize, NULL);
-    /* Map output srcfer */
-    GstMapInfo omap;
-    if (!osrc || !gst_buffer_map(osrc, &omap, GST_MAP_WRITE)) {
-        printf("Cannot map output srcfer\n");
-        return NULL;
-    }
+struct defisheye_lens {
+    struct defisheye_params params;
+    float centerX;
+    float centerY;
+    /* radius of the circle */
+    float r;
+    /* Same of the destination, the radius divided down by the zoom */
+    float dstX;
+    float dstY;
+    float dstR;
+    /* Projection models: tangent of the half view and lens radius of a
+     * unit focal length at the half fov, both in units of r */
+    float view;
+    float focal;
+    /* Direction of the virtual camera */
+    float cosPan;
+    float sinPan;
+    float cosTilt;
+    float sinTilt;
+    /* Panoramas: azimuth of the centre column and radians per pixel, the
+     * angle to the axis of the top row and its cotangent */
+    float azimuth;
+    float step;
+    float top;
+    float cotTop;
+};
+
+/* Source position of one destination pixel */
+static void defisheye_point(void* arg, float x, float y, float* sx, float* sy)
+{
+    const struct defisheye_lens* lens = arg;
+    const struct defisheye_params* p = &lens->params;
+
+    /* cartesian coordinates of the destination point
+     * (relative to the centre of the image)
+     */
+    float deltaX = (x - lens->dstX) / lens->dstR;
+    float deltaY = (y - lens->dstY) / lens->dstR;
+
+    /* distance or radius of destination image */
+    float dstR = sqrtf(deltaX * deltaX + deltaY * deltaY);
+
+    /* distance or radius of src image (with formula)
+     * r_src = (a * r3_corr + b * r2_corr + c * r_corr + d) * r_corr
+     */
+    float srcR = (((p->a * dstR + p->b) * dstR + p->c) * dstR + p->d) * dstR;
 
-    /* Get destination memory pointers */
-    oYptr = omap.data;
-    /* Get source memory pointers */
-    iYptr = src;
+    /* comparing old and new distance to get factor, the centre stays */
+    float factor = fabsf(srcR) > FLT_EPSILON ? fabsf(dstR / srcR) : 1.0f;
 
-    /* Check valid pointers to the memory */
-    if (!oYptr || !iYptr) {
-        printf("Invalid memory poiter In:%p Out:%p\n", iYptr, oYptr);
-        return NULL;
+    /* coordinates in source image */
+    *sx = lens->centerX + (deltaX * factor * lens->r);
+    *sy = lens->centerY + (deltaY * factor * lens->r);
+}
+
+/* Fisheye projections, see docs/Fisheye-Lens-Effect-and-Angle-of-View.png
+ *
+ * A ray at angle theta from the optical axis lands at radius
+ *   equidistant     r = f * theta
+ *   equisolid       r = 2f * sin(theta / 2)
+ *   stereographic   r = 2f * tan(theta / 2)
+ *   orthographic    r = f * sin(theta)
+ * on the sensor, and at r = f * tan(theta) for a rectilinear lens. The
+ * fov of the lens spans the image circle, the view of the output the same
+ * circle of the destination, so a destination radius gives theta through
+ * the rectilinear projection and theta the source radius.
+ */
+static float defisheye_radius(enum lens_model model, float theta)
+{
+    switch (model) {
+    case LENS_EQUISOLID:
+        return 2.0f * sinf(0.5f * theta);
+    case LENS_STEREOGRAPHIC:
+        return 2.0f * tanf(0.5f * theta);
+    case LENS_ORTHOGRAPHIC:
+        /* Nothing is imaged past the side of the hemisphere */
+        return sinf(fminf(theta, (float)M_PI_2));
+    case LENS_EQUIDISTANT:
+    default:
+        return theta;
     }
+}
 
-    if (fmt->pixelformat == PIXEL_YV12) {
-        const unsigned int yplane_ssize = (fmt->width * fmt->height);
-        const unsigned int uplane_ssize = (fmt->width >> 1) *
-                                          (fmt->height >> 1);
-        iUptr = iYptr + yplane_ssize;
-        oUptr = oYptr + yplane_ssize;
+/* Source position of one destination pixel, projection models */
+static void defisheye_project(void* arg, float x, float y, float* sx,
+                              float* sy)
+{
+    const struct defisheye_lens* lens = arg;
+
+    float deltaX = (x - lens->dstX) / lens->dstR;
+    float deltaY = (y - lens->dstY) / lens->dstR;
+    float dstR   = sqrtf(deltaX * deltaX + deltaY * deltaY);
+
+    /* angle of the ray and its radius on the fisheye sensor */
+    float theta = atanf(dstR * lens->view);
+    float srcR  = defisheye_radius(lens->params.model, theta) / lens->focal;
+
+    /* the centre is scaled by the slope of both projections at the axis */
+    float factor = fabsf(dstR) > FLT_EPSILON ? srcR / dstR :
+                   lens->view / lens->focal;
+
+    *sx = lens->centerX + (deltaX * factor * lens->r);
+    *sy = lens->centerY + (deltaY * factor * lens->r);
+}
+
+/**
+ * Source position of one destination pixel of a virtual camera turned
+ * away from the lens axis. The ray of the rectilinear view is tilted
+ * from the axis towards the top of the frame, then panned around the
+ * axis. Its angle to the axis gives the source radius as in
+ * defisheye_project(), the polynomial model takes the equidistant one.
+ */
+static void defisheye_view(void* arg, float x, float y, float* sx, float* sy)
+{
+    const struct defisheye_lens* lens = arg;
+
+    /* ray of the view, z along its axis */
+    float u = (x - lens->dstX) / lens->dstR * lens->view;
+    float v = (y - lens->dstY) / lens->dstR * lens->view;
+    float ry = v * lens->cosTilt - lens->sinTilt;
+    float rz = v * lens->sinTilt + lens->cosTilt;
+    float rx = u * lens->cosPan - ry * lens->sinPan;
+
+    ry = u * lens->sinPan + ry * lens->cosPan;
+
+    float side  = sqrtf(rx * rx + ry * ry);
+    float theta = atan2f(side, rz);
+    float srcR  = defisheye_radius(lens->params.model, theta) / lens->focal;
+    float factor = side > FLT_EPSILON ? srcR * lens->r / side : 0.0f;
+
+    *sx = lens->centerX + rx * factor;
+    *sy = lens->centerY + ry * factor;
+}
+
+/**
+ * Source position of one destination pixel of a panorama. Columns go
+ * clockwise around the lens axis on the source, rows from the top one
+ * towards the axis with square pixels: in equal angles for the
+ * equirectangular projection, in equal heights on a cylinder around the
+ * axis for the cylindrical one. Upright for a ceiling mount.
+ */
+static void defisheye_unwrap(void* arg, float x, float y, float* sx,
+                             float* sy)
+{
+    const struct defisheye_lens* lens = arg;
+
+    float phi   = lens->azimuth + (x - lens->dstX) * lens->step;
+    float theta = lens->params.projection == PROJECTION_CYLINDRICAL ?
+                  atan2f(1.0f, lens->cotTop + y * lens->step) :
+                  lens->top - y * lens->step;
+    float srcR  = defisheye_radius(lens->params.model, theta) / lens->focal;
+
+    *sx = lens->centerX + srcR * lens->r * sinf(phi);
+    *sy = lens->centerY - srcR * lens->r * cosf(phi);
+}
 
-        iVptr = iYptr + yplane_ssize + uplane_ssize;
-        oVptr = oYptr + yplane_ssize + uplane_ssize;
+void defisheye_default_params(struct defisheye_params* params)
+{assert(params);
+
+    params->model = LENS_POLYNOMIAL;
+    params->a = DEFISHEYE_A;
+    params->b = DEFISHEYE_B;
+    params->c = DEFISHEYE_C;
+    params->d = DEFISHEYE_D;
+    params->fov  = DEFISHEYE_FOV;
+    params->view = DEFISHEYE_VIEW;
+    params->zoom = DEFISHEYE_ZOOM;
+    params->pan  = DEFISHEYE_PAN;
+    params->tilt = DEFISHEYE_TILT;
+    params->projection = PROJECTION_RECTILINEAR;
+    params->span = DEFISHEYE_SPAN;
+}
 
-    } else {
+/* Turned views take the projection path whatever the model */
+static bool defisheye_directed(const struct defisheye_params* params)
+{
+    return fabsf(params->pan) > FLT_EPSILON ||
+           fabsf(params->tilt) > FLT_EPSILON;
+}
 
-        iUptr = iYptr + 1;
-        oUptr = oYptr + 1;
+/* So do panoramas */
+static bool defisheye_panorama(const struct defisheye_params* params)
+{
+    return params->projection != PROJECTION_RECTILINEAR;
+}
 
-        iVptr = iUptr + 1;
-        oVptr = oUptr + 1;
+/**
+ * Samples per destination pixel along each axis, as many as the source
+ * pixels it spans at the centre, or along the top row of a panorama. Up to
+ * 1.5 source pixels bilinear sampling holds without aliasing.
+ */
+static uint32_t defisheye_sample_shift(const struct defisheye_lens* lens)
+{
+    const struct defisheye_params* p = &lens->params;
+    /* Slope of the correction at the axis */
+    float slope = p->model != LENS_POLYNOMIAL || defisheye_directed(p) ?
+                  lens->view / lens->focal :
+                  fabsf(p->d) > FLT_EPSILON ? 1.0f / fabsf(p->d) : 1.0f;
+    float ratio = slope * lens->r / lens->dstR;
+    uint32_t shift = 0;
+
+    if (defisheye_panorama(p)) {
+        /* Along the circle of the top row and across it */
+        float radius = defisheye_radius(p->model, lens->top);
+        float inner  = defisheye_radius(p->model, lens->top - lens->step);
+
+        ratio = fmaxf(fabsf(radius), fabsf(radius - inner) / lens->step) *
+                lens->r * lens->step / lens->focal;
     }
 
-    /*
-     * a, b, c and FoV are physical properties of a lens/camera-combination
-     * at a given focus distance. At different focus settings, FoV will
-     * change noticeably, but usually it is fine to reuse a, b, and c even then.
-     */
+    while (shift < REMAP_MAX_SAMPLE_SHIFT && ratio > 1.5f * (1U << shift)) {
+        shift++;
+    }
+    return shift;
+}
 
-    float a = +0.000; /* affects only the outermost pixels of the image */
-    float b = +0.076; /* most cases only require b optimization         */
-    float c = +0.000; /* uniform correction                             */
-    float d = +1.050; /* Scaling of the image                           */
+/**
+ * Angle of the top row of a panorama to the lens axis. A tilt up to the
+ * axis or back past its opposite would fold the rows over, it stops short.
+ */
+static float defisheye_top(const struct defisheye_params* params)
+{
+    const float top = 0.5f * params->fov - params->tilt;
 
-    float deltaX, deltaY, dstR, srcR, factor, srcXd, srcYd = 0;
+    return clamp(top, DEFISHEYE_TOP_MARGIN, 180.0f - DEFISHEYE_TOP_MARGIN) *
+           (float)M_PI / 180.0f;
+}
 
-    float const centerX = (float)(fmt->width  >> 1);
-    float const centerY = (float)(fmt->height >> 1);
+/**
+ * The correction depends on the frame sizes and the lens only, it is
+ * evaluated once per pixel here instead of on every frame. Every model
+ * generates the same table, the choice costs nothing per frame, and so
+ * does the scaling.
+ */
+struct remap_table* prepare_defisheye_table(const struct image_format* fmt,
+                              const struct image_format* out,
+                              const struct defisheye_params* params,
+                              uint32_t mesh_shift, struct worker_pool* pool)
+{assert(fmt && out && params && params->zoom > 0.0f);
+ assert((params->model == LENS_POLYNOMIAL && !defisheye_directed(params) &&
+         !defisheye_panorama(params)) ||
+        (params->fov  > 0.0f && params->fov  < 360.0f &&
+         params->view > 0.0f && params->view < 180.0f));
+ assert(!defisheye_panorama(params) ||
+        (params->span > 0.0f && params->span <= 360.0f));
+
+    struct defisheye_lens lens = {
+        .params  = *params,
+        .centerX = (float)(fmt->width  >> 1),
+        .centerY = (float)(fmt->height >> 1),
+        .r       = (float)(min(fmt->width, fmt->height) >> 1),
+        .dstX    = (float)(out->width  >> 1),
+        .dstY    = (float)(out->height >> 1),
+        .dstR    = (float)(min(out->width, out->height) >> 1) * params->zoom,
+        .view    = tanf(0.5f * params->view * (float)M_PI / 180.0f),
+        .focal   = defisheye_radius(params->model,
+                                    0.5f * params->fov * (float)M_PI / 180.0f),
+        .cosPan  = cosf(params->pan  * (float)M_PI / 180.0f),
+        .sinPan  = sinf(params->pan  * (float)M_PI / 180.0f),
+        .cosTilt = cosf(params->tilt * (float)M_PI / 180.0f),
+        .sinTilt = sinf(params->tilt * (float)M_PI / 180.0f),
+        .azimuth = params->pan * (float)M_PI / 180.0f,
+        .step    = params->span * (float)M_PI / 180.0f / (float)out->width,
+        .top     = defisheye_top(params),
+    };
+    remap_func_t func = defisheye_panorama(params) ? defisheye_unwrap :
+                        defisheye_directed(params) ? defisheye_view :
+                        params->model == LENS_POLYNOMIAL ? defisheye_point :
+                                                           defisheye_project;
+    assert(lens.top > 0.0f && lens.top < (float)M_PI);
+    lens.cotTop = cosf(lens.top) / sinf(lens.top);
+
+    struct remap_table* table = prepare_remap_table(
+        out->width, out->height, fmt->width, fmt->height, mesh_shift,
+        defisheye_sample_shift(&lens));
 
-    /* radius of the circle */
-    unsigned int r = min(fmt->width, fmt->height) >> 1;
-
-    for (unsigned int x = 0; x < fmt->width; x++) {
-        for (unsigned int y = 0; y < fmt->height; y++) {
-
-            /* cartesian coordinates of the destination point
-             * (relative to the centre of the image)
-             */
-            deltaX = (x - centerX) / r;
-            deltaY = (y - centerY) / r;
-
-            /* distance or radius of destination image */
-            dstR = sqrt(pow(deltaX, 2) + pow(deltaY, 2));
-
-            /* distance or radius of src image (with formula)
-             * r_src = (a * r3_corr + b * r2_corr + c * r_corr + d) * r_corr
-             */
-            srcR = (a * pow(dstR, 3) + b * pow(dstR, 2) + c * dstR + d) * dstR;
-
-            /* comparing old and new distance to get factor */
-            factor = fabs(dstR / srcR);
-
-            /* coordinates in source image */
-            srcXd = centerX + (deltaX * factor * r);
-            srcYd = centerY + (deltaY * factor * r);
-
-            /* Casting the float coordinates into int */
-            unsigned int calcX = min((unsigned int)srcXd, fmt->width  - 1);
-            unsigned int calcY = min((unsigned int)srcYd, fmt->height - 1);
-
-            /* Source pixel offset */
-            soffs = (calcY * fmt->width) + calcX;
-            /* Destination pixel offset */
-            doffs = (y * fmt->width) + x;
-
-            /* Update YV12 or RGB planes */
-            if (fmt->pixelformat == PIXEL_YV12) {
-                /* Update Y plane */
-                oYptr[doffs] = iYptr[soffs];
-
-                /* Source pixel offset for U and V planes */
-                soffs = ((calcY >> 1) * (fmt->bytesperline >> 1)) +
-                         (calcX >> 1);
-                /* Destination pixel offset for U and V planes*/
-                doffs = ((y >> 1) * (fmt->bytesperline >> 1)) + (x >> 1);
-
-                /* Update U plane */
-                oUptr[doffs] = iUptr[soffs];
-                /* Update V plane */
-                oVptr[doffs] = iVptr[soffs];
-            } else {
-                uint8_t bpp = fmt->bytesperline / fmt->width;
-                /* Update R plane */
-                oYptr[doffs * bpp] = iYptr[soffs * bpp];
-                /* Update G plane */
-                oUptr[doffs * bpp] = iUptr[soffs * bpp];
-                /* Update B plane */
-                oVptr[doffs * bpp] = iVptr[soffs * bpp];
-            }
-        }
+    if (fmt->pixelformat == PIXEL_YV12) {
+        /* Chroma planes at their own resolution */
+        prepare_remap_chroma(table);
     }
 
-    /* TODO: Remove copy */
-    memcpy(src, omap.data, omap.size);
+#ifdef CALC_TOTAL_DURATION
+    /* start time */
+    TimeNode_t point;
+    point.symbolic = HOOK_ID;
+    init_reference_point(point.symbolic, &point);
+#endif
+    build_remap_table(table, func, &lens, pool);
+#ifdef CALC_TOTAL_DURATION
+    /* stop time */
+    init_reference_point(point.symbolic, &point);
+#endif
+
+    return table;
+}
+
+/* Floats in hex, to match exactly */
+void defisheye_table_key(const struct image_format* fmt,
+                         const struct image_format* out,
+                         const struct defisheye_params* params,
+                         uint32_t mesh_shift, char key[REMAP_KEY_SIZE])
+{assert(fmt && out && params && key);
+
+    snprintf(key, REMAP_KEY_SIZE,
+             "defisheye %ux%u to %ux%u format %d model %d a %a b %a c %a "
+             "d %a fov %a view %a zoom %a pan %a tilt %a projection %d "
+             "span %a mesh %u", fmt->width, fmt->height, out->width,
+             out->height, fmt->pixelformat, params->model, params->a,
+             params->b, params->c, params->d, params->fov, params->view,
+             params->zoom, params->pan, params->tilt, params->projection,
+             params->span, mesh_shift);
+}
+
+/**
+ * Tables of the same frame format and lens are the same on every run, they
+ * are kept in files named after a hash of the key. The key itself is in
+ * the file and checked on load.
+ */
+struct remap_table* load_defisheye_table(const struct image_format* fmt,
+                              const struct image_format* out,
+                              const struct defisheye_params* params,
+                              uint32_t mesh_shift, const char* cache_dir,
+                              struct worker_pool* pool)
+{assert(fmt && out && params && cache_dir);
+
+    char key[REMAP_KEY_SIZE];
+    char path[PATH_MAX];
+    struct remap_table* table;
+
+    defisheye_table_key(fmt, out, params, mesh_shift, key);
+    snprintf(path, sizeof(path), "%s/defisheye-%ux%u-%016lx.remap",
+             cache_dir, out->width, out->height, djb2_hash(key));
+
+    table = load_remap_table(path, key);
+    if (table) {
+        return table;
+    }
 
-    /* Unmapping the output srcfer */
-    if (oYptr != NULL) {
-        gst_buffer_unmap(osrc, &omap);
-        gst_buffer_unref(osrc);
+    table = prepare_defisheye_table(fmt, out, params, mesh_shift, pool);
+    if ((mkdir(cache_dir, 0755) && errno != EEXIST) ||
+        !store_remap_table(table, path, key)) {
+        fprintf(stderr, "Cannot store remap table %s\n", path);
     }
+    return table;
+}
 
-    return NULL;
+void calculate_defisheye(const uint8_t* src, uint8_t* dst,
+                         const struct image_format* fmt,
+                         const struct image_format* out,
+                         const struct remap_table* table,
+                         enum interpolation interp, struct worker_pool* pool)
+{assert(src && dst && fmt && out && table);
+
+#ifdef CALC_TOTAL_DURATION
+    /* start time */
+    TimeNode_t point;
+    point.symbolic = HOOK_ID;
+    init_reference_point(point.symbolic, &point);
+#endif
+    /* The table holds the source position of every destination pixel */
+    remap_frame(table, src, dst, fmt, out, interp, pool);
+#ifdef CALC_TOTAL_DURATION
+    /* stop time */
+    init_reference_point(point.symbolic, &point);
+#endif
 }
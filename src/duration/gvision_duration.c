@@ -29,9 +29,14 @@
 
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 static Hashmap* reference_point = NULL;
 
+/* Element instances sharing the map, guarded by map_lock */
+static unsigned int map_users = 0;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static unsigned long symbols_hash(void *key)
 {
     return sdbm_hash(key);
@@ -58,17 +63,25 @@ static bool remove_str_to_int(void *key, void *value, void *context)
 void prepare_duration_hashmaps(size_t initialCapacity)
 {assert(initialCapacity);
 
-    reference_point = hashmapCreate(initialCapacity, symbols_hash,
-                                    str_icase_equals);
-    assert(reference_point);
+    pthread_mutex_lock(&map_lock);
+    if (!map_users++) {
+        reference_point = hashmapCreate(initialCapacity, symbols_hash,
+                                        str_icase_equals);
+        assert(reference_point);
+    }
+    pthread_mutex_unlock(&map_lock);
 }
 
 void release_duration_hashmaps()
-{assert(reference_point);
-
-    hashmapForEach(reference_point, remove_str_to_int, reference_point);
-    hashmapFree(reference_point);
-    reference_point = NULL;
+{
+    pthread_mutex_lock(&map_lock);
+    assert(reference_point && map_users);
+    if (!--map_users) {
+        hashmapForEach(reference_point, remove_str_to_int, reference_point);
+        hashmapFree(reference_point);
+        reference_point = NULL;
+    }
+    pthread_mutex_unlock(&map_lock);
 }
 
 unsigned long init_reference_point(const char* name, TimeNode_t* tn)
@@ -31,6 +31,7 @@
 #include <gst/gstvalue.h>
 
 #include "gvision_base.h"
+#include "gvision_ptz.h"
 
 #include "defisheye/gvision_defisheye.h"
 #include "histogram/gvision_histogram.h"
@@ -46,6 +47,7 @@ static gboolean plugin_init (GstPlugin * plugin)
     GType type;
   } *element, elements[] = {
     {"gvision", GVISION_BASE_TYPE},
+    {"gvisionptz", GVISION_PTZ_TYPE},
     {NULL, 0},
   };
 
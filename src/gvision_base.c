@@ -48,12 +48,40 @@ enum {
 
 enum {
   PROP_0,
-  PROP_SILENT
+  PROP_SILENT,
+  PROP_MODE,
+  PROP_WHITE_BALANCE,
+  PROP_INTERPOLATION,
+  PROP_MAP_TYPE,
+  PROP_LENS_MODEL,
+  PROP_FOV,
+  PROP_VIEW,
+  PROP_ZOOM,
+  PROP_PAN,
+  PROP_TILT,
+  PROP_PROJECTION,
+  PROP_SPAN,
+  PROP_A,
+  PROP_B,
+  PROP_C,
+  PROP_D,
+  PROP_CACHE_DIR,
+  PROP_CACHE_SIZE,
+  PROP_MAP_FILE,
+  PROP_THREADS,
+  PROP_CPU_LIST,
+  PROP_NUMA_NODE,
+  PROP_SCHED_POLICY,
+  PROP_SCHED_PRIORITY,
+  PROP_SHARED_POOL,
+  PROP_POOL_PRIORITY,
+  PROP_FRAMES_IN_FLIGHT,
+  PROP_AUTO_TUNE,
+  PROP_STATS
 };
 
 /* TODO: */
 FILE *gplot_hd = NULL;
-static struct image_format bfmt;
 
 /* the capabilities of the inputs and outputs.
  *
@@ -75,10 +103,132 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
         "video/x-raw,format=RGB;")
     );
 
+#define GST_TYPE_GVISION_MODE (gst_gvision_mode_get_type())
+static GType gst_gvision_mode_get_type(void)
+{
+    static GType mode_type = 0;
+    static const GEnumValue modes[] = {
+        {MODE_EQUALIZE, "Histogram equalization", "equalize"},
+        {MODE_AUTO_LEVELS, "Percentile contrast stretch", "auto-levels"},
+        {MODE_DEFISHEYE, "Barrel distortion correction", "defisheye"},
+        {MODE_REMAP, "Calibrated maps of map-file", "remap"},
+        {0, NULL, NULL},
+    };
+
+    if (!mode_type) {
+        mode_type = g_enum_register_static("GstGVisionMode", modes);
+    }
+    return mode_type;
+}
+
+#define GST_TYPE_GVISION_WHITE_BALANCE (gst_gvision_white_balance_get_type())
+static GType gst_gvision_white_balance_get_type(void)
+{
+    static GType balance_type = 0;
+    static const GEnumValue balances[] = {
+        {WB_NONE, "No white balance", "none"},
+        {WB_GRAY_WORLD, "Gray world", "gray-world"},
+        {WB_WHITE_PATCH, "White patch", "white-patch"},
+        {0, NULL, NULL},
+    };
+
+    if (!balance_type) {
+        balance_type = g_enum_register_static("GstGVisionWhiteBalance",
+                                              balances);
+    }
+    return balance_type;
+}
+
+GType gst_gvision_interpolation_get_type(void)
+{
+    static GType interp_type = 0;
+    static const GEnumValue interps[] = {
+        {INTERP_NEAREST, "Nearest neighbour", "nearest"},
+        {INTERP_BILINEAR, "Bilinear", "bilinear"},
+        {INTERP_BICUBIC, "Bicubic, Catmull-Rom", "bicubic"},
+        {0, NULL, NULL},
+    };
+
+    if (!interp_type) {
+        interp_type = g_enum_register_static("GstGVisionInterpolation",
+                                             interps);
+    }
+    return interp_type;
+}
+
+GType gst_gvision_lens_model_get_type(void)
+{
+    static GType model_type = 0;
+    static const GEnumValue models[] = {
+        {LENS_POLYNOMIAL, "Barrel polynomial", "polynomial"},
+        {LENS_EQUIDISTANT, "Equidistant fisheye", "equidistant"},
+        {LENS_EQUISOLID, "Equisolid angle fisheye", "equisolid"},
+        {LENS_STEREOGRAPHIC, "Stereographic fisheye", "stereographic"},
+        {LENS_ORTHOGRAPHIC, "Orthographic fisheye", "orthographic"},
+        {0, NULL, NULL},
+    };
+
+    if (!model_type) {
+        model_type = g_enum_register_static("GstGVisionLensModel", models);
+    }
+    return model_type;
+}
+
+#define GST_TYPE_GVISION_PROJECTION (gst_gvision_projection_get_type())
+static GType gst_gvision_projection_get_type(void)
+{
+    static GType projection_type = 0;
+    static const GEnumValue projections[] = {
+        {PROJECTION_RECTILINEAR, "Rectilinear view", "rectilinear"},
+        {PROJECTION_CYLINDRICAL, "Cylindrical panorama", "cylindrical"},
+        {PROJECTION_EQUIRECTANGULAR, "Equirectangular panorama",
+         "equirectangular"},
+        {0, NULL, NULL},
+    };
+
+    if (!projection_type) {
+        projection_type = g_enum_register_static("GstGVisionProjection",
+                                                 projections);
+    }
+    return projection_type;
+}
+
+GType gst_gvision_map_type_get_type(void)
+{
+    static GType map_type = 0;
+    static const GEnumValue maps[] = {
+        {MAP_FULL, "Position per pixel", "full"},
+        {MAP_MESH, "Mesh interpolated per frame", "mesh"},
+        {0, NULL, NULL},
+    };
+
+    if (!map_type) {
+        map_type = g_enum_register_static("GstGVisionMapType", maps);
+    }
+    return map_type;
+}
+
+#define GST_TYPE_GVISION_SCHED_POLICY (gst_gvision_sched_policy_get_type())
+static GType gst_gvision_sched_policy_get_type(void)
+{
+    static GType policy_type = 0;
+    static const GEnumValue policies[] = {
+        {POLICY_OTHER, "Time sharing, priority is the nice value", "other"},
+        {POLICY_FIFO, "Real-time first in first out", "fifo"},
+        {0, NULL, NULL},
+    };
+
+    if (!policy_type) {
+        policy_type = g_enum_register_static("GstGVisionSchedPolicy",
+                                             policies);
+    }
+    return policy_type;
+}
+
 #define gst_gvision_plugin_parent_class parent_class
 G_DEFINE_TYPE (GstGVisionPlugin, gst_gvision_plugin, GST_TYPE_ELEMENT);
 
-static void gvision_get_video_caps(GstCaps *caps)
+void gvision_get_video_caps(struct image_format *fmt, GstCaps *caps)
 {
     const GstStructure *str;
     gint value;
@@ -94,33 +244,539 @@ static void gvision_get_video_caps(GstCaps *caps)
         GST_ERROR("No image width\n");
         return;
     }
-    bfmt.width = value;
+    fmt->width = value;
 
     if (!gst_structure_get_int(str, "height", &value)) {
         GST_ERROR("No image width\n");
         return;
     }
-    bfmt.height = value;
+    fmt->height = value;
 
-    const gchar *fmt = gst_structure_get_string(str, "format");
-    if (fmt == NULL) {
+    const gchar *format = gst_structure_get_string(str, "format");
+    if (format == NULL) {
         GST_ERROR("Could not get format from src caps");
     }
 
-    switch (GST_STR_FOURCC(fmt)) {
+    switch (GST_STR_FOURCC(format)) {
         case GST_MAKE_FOURCC('Y','V','1','2'):
-            bfmt.pixelformat  = PIXEL_YV12;
-            bfmt.bytesperline = bfmt.width;
-            bfmt.size         = bfmt.height * bfmt.bytesperline;
+            fmt->pixelformat  = PIXEL_YV12;
+            fmt->bytesperline = fmt->width;
+            fmt->size         = fmt->height * fmt->bytesperline;
             break;
         default:
-            bfmt.pixelformat  = PIXEL_RGB;
-            bfmt.bytesperline = bfmt.width * 3;
-            bfmt.size         = bfmt.height * bfmt.bytesperline;
-            bfmt.colorspace   = COLOR_RGB;
+            fmt->pixelformat  = PIXEL_RGB;
+            fmt->bytesperline = fmt->width * 3;
+            fmt->size         = fmt->height * fmt->bytesperline;
+            fmt->colorspace   = COLOR_RGB;
+    }
+    g_print("Width : %d\nHeight: %d Fmt:%d\n", fmt->width, fmt->height,
+            fmt->pixelformat);
+}
+
+/* Apply the selected processing to a mapped frame */
+static void gvision_process(struct gvision_frame *frame,
+                            struct worker_pool *pool)
+{
+    GstGVisionPlugin *filter = frame->filter;
+    uint8_t* pixels = frame->map.data;
+
+    switch (frame->mode) {
+        case MODE_EQUALIZE:
+            equalize_histogram(pixels, &filter->format, filter->levels,
+                               frame->balance, pool);
+            break;
+        case MODE_AUTO_LEVELS:
+            autolevels_histogram(pixels, &filter->format, filter->levels,
+                                 frame->balance, pool);
+            break;
+        case MODE_DEFISHEYE:
+            /* Rectify distortion */
+            calculate_defisheye(pixels, frame->out_map.data, &filter->format,
+                                &filter->out_format, frame->remap,
+                                frame->interp, pool);
+            break;
+        case MODE_REMAP:
+            /* Through the same gather as defisheye */
+            remap_frame(frame->remap, pixels, frame->out_map.data,
+                        &filter->format, &filter->out_format, frame->interp,
+                        pool);
+            break;
+    }
+}
+
+/* A whole frame is one work item, its kernels run on a single worker */
+static void gvision_frame_job(void *arg, uint32_t begin, uint32_t end,
+                              unsigned int worker)
+{
+    struct gvision_frame *frame = arg;
+
+    gvision_process(frame, NULL);
+}
+
+/**
+ * Modes writing into a new buffer, the input is only read. They scale to
+ * the size downstream takes.
+ */
+static gboolean gvision_out_of_place(enum gvision_mode mode)
+{
+    return mode == MODE_DEFISHEYE || mode == MODE_REMAP;
+}
+
+gsize gvision_frame_size(const struct image_format *fmt)
+{
+    if (fmt->pixelformat == PIXEL_YV12) {
+        return fmt->size +
+               2 * (gsize)(fmt->bytesperline >> 1) * (fmt->height >> 1);
+    }
+    return fmt->size;
+}
+
+/* Pool of output buffers of the current caps, set up with the first one */
+static GstBufferPool *gvision_output_pool(GstGVisionPlugin *filter,
+                                          gsize size)
+{
+    if (!filter->out_pool) {
+        GstCaps *caps = gst_pad_get_current_caps(filter->srcpad);
+        GstBufferPool *pool = gst_buffer_pool_new();
+        GstStructure *config = gst_buffer_pool_get_config(pool);
+
+        gst_buffer_pool_config_set_params(config, caps, size, 2, 0);
+        if (caps) {
+            gst_caps_unref(caps);
+        }
+        if (!gst_buffer_pool_set_config(pool, config) ||
+            !gst_buffer_pool_set_active(pool, TRUE)) {
+            GST_ERROR("Cannot set up the output buffer pool");
+            gst_object_unref(pool);
+            return NULL;
+        }
+        filter->out_pool = pool;
+    }
+    return filter->out_pool;
+}
+
+static void gvision_release_output_pool(GstGVisionPlugin *filter)
+{
+    if (filter->out_pool) {
+        gst_buffer_pool_set_active(filter->out_pool, FALSE);
+        gst_object_unref(filter->out_pool);
+        filter->out_pool = NULL;
+    }
+}
+
+/**
+ * Map the frame for its mode: in place modes write the input, the others
+ * read it and write a buffer from the output pool. FALSE leaves the input
+ * untouched and unmapped.
+ */
+static gboolean gvision_map_frame(GstGVisionPlugin *filter,
+                                  struct gvision_frame *frame, GstBuffer *buf)
+{
+    GstBufferPool *pool;
+    gsize size = gst_buffer_get_size(buf);
+
+    frame->filter  = filter;
+    frame->mode    = filter->mode;
+    frame->balance = filter->balance;
+    frame->interp  = filter->interp;
+    frame->buffer  = buf;
+    frame->output  = NULL;
+    frame->task    = NULL;
+    frame->remap   = NULL;
+
+    if (!gvision_out_of_place(frame->mode)) {
+        return gst_buffer_map(buf, &frame->map, GST_MAP_WRITE);
+    }
+
+    if (filter->out_format.width != filter->format.width ||
+        filter->out_format.height != filter->format.height) {
+        size = gvision_frame_size(&filter->out_format);
+    }
+    pool = gvision_output_pool(filter, size);
+    if (!pool ||
+        gst_buffer_pool_acquire_buffer(pool, &frame->output, NULL) !=
+        GST_FLOW_OK) {
+        frame->output = NULL;
+        return FALSE;
+    }
+    if (!gst_buffer_map(buf, &frame->map, GST_MAP_READ)) {
+        gst_buffer_unref(frame->output);
+        frame->output = NULL;
+        return FALSE;
+    }
+    if (!gst_buffer_map(frame->output, &frame->out_map, GST_MAP_WRITE)) {
+        gst_buffer_unmap(buf, &frame->map);
+        gst_buffer_unref(frame->output);
+        frame->output = NULL;
+        return FALSE;
+    }
+    if (filter->remap) {
+        /* Kept by the frame across a swap of the filter table */
+        frame->remap = remap_table_ref(filter->remap);
+    }
+    return TRUE;
+}
+
+/* Unmap a processed frame, returns the buffer to push */
+static GstBuffer *gvision_unmap_frame(struct gvision_frame *frame)
+{
+    GstBuffer *buffer = frame->buffer;
+
+    gst_buffer_unmap(frame->buffer, &frame->map);
+    if (frame->output) {
+        gst_buffer_unmap(frame->output, &frame->out_map);
+        /* Timestamps and flags of the input */
+        gst_buffer_copy_into(frame->output, frame->buffer,
+                             GST_BUFFER_COPY_METADATA, 0, -1);
+        gst_buffer_unref(frame->buffer);
+        buffer = frame->output;
+    }
+    release_remap_table(frame->remap);
+    frame->remap  = NULL;
+    frame->buffer = NULL;
+    frame->output = NULL;
+    return buffer;
+}
+
+/**
+ * An out of place mode has nothing to push when a buffer of the frame could
+ * not be mapped, in place modes pass the input through untouched instead
+ */
+static GstFlowReturn gvision_map_error(GstGVisionPlugin *filter,
+                                       struct gvision_frame *frame)
+{
+    GST_ELEMENT_ERROR(filter, STREAM, FAILED,
+                      ("Cannot map the buffers of the frame"), (NULL));
+    gst_buffer_unref(frame->buffer);
+    frame->buffer = NULL;
+    return GST_FLOW_ERROR;
+}
+
+/* Wait for the oldest frame, then push it downstream or drop it */
+static GstFlowReturn gvision_pop_frame(GstGVisionPlugin *filter,
+                                       gboolean push)
+{
+    struct gvision_frame *frame = &filter->frames[filter->frame_head];
+    GstBuffer *buffer = frame->buffer;
+
+    if (frame->task) {
+        pool_wait(filter->pool, frame->task);
+        buffer = gvision_unmap_frame(frame);
+    }
+    frame->task   = NULL;
+    frame->buffer = NULL;
+    filter->frame_head = (filter->frame_head + 1) % filter->frames_in_flight;
+    filter->frame_count--;
+
+    if (!push) {
+        gst_buffer_unref(buffer);
+        return GST_FLOW_OK;
+    }
+    return gst_pad_push(filter->srcpad, buffer);
+}
+
+/* Release every queued frame in arrival order, the rest is dropped on error */
+static GstFlowReturn gvision_drain_frames(GstGVisionPlugin *filter,
+                                          gboolean push)
+{
+    GstFlowReturn ret = GST_FLOW_OK;
+
+    while (filter->frame_count) {
+        GstFlowReturn res = gvision_pop_frame(filter, push &&
+                                              ret == GST_FLOW_OK);
+        if (ret == GST_FLOW_OK) {
+            ret = res;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Queue the frame on the pool. Frames leave in arrival order: finished ones
+ * at once, the oldest one is waited for when the window is full.
+ */
+static GstFlowReturn gvision_queue_frame(GstGVisionPlugin *filter,
+                                         GstBuffer *buf)
+{
+    struct gvision_frame *frame;
+
+    if (!filter->frames) {
+        filter->frames = g_new0(struct gvision_frame,
+                                filter->frames_in_flight);
+    }
+
+    while (filter->frame_count) {
+        struct gvision_frame *head = &filter->frames[filter->frame_head];
+        if (filter->frame_count < filter->frames_in_flight &&
+            head->task && !pool_ready(head->task)) {
+            break;
+        }
+        GstFlowReturn ret = gvision_pop_frame(filter, TRUE);
+        if (ret != GST_FLOW_OK) {
+            gst_buffer_unref(buf);
+            return ret;
+        }
+    }
+
+    frame = &filter->frames[(filter->frame_head + filter->frame_count) %
+                            filter->frames_in_flight];
+    if (gvision_map_frame(filter, frame, buf)) {
+        struct pool_job job = {gvision_frame_job, frame, 0, 1, 1, 0};
+        frame->task = pool_submit(filter->pool, &job);
+    } else if (gvision_out_of_place(frame->mode)) {
+        return gvision_map_error(filter, frame);
+    }
+    filter->frame_count++;
+
+    return GST_FLOW_OK;
+}
+
+/* Table of the lens, from the cache directory when there is one */
+static struct remap_table *gvision_build_remap(const gchar *cache_dir,
+                                               const struct image_format *fmt,
+                                               const struct image_format *out,
+                                               const struct defisheye_params *lens,
+                                               uint32_t mesh_shift,
+                                               struct worker_pool *pool)
+{
+    if (cache_dir) {
+        return load_defisheye_table(fmt, out, lens, mesh_shift, cache_dir,
+                                    pool);
+    }
+    return prepare_defisheye_table(fmt, out, lens, mesh_shift, pool);
+}
+
+/* Build the table of the rebuild on a worker */
+static void gvision_rebuild_job(void *arg, uint32_t begin, uint32_t end,
+                                unsigned int worker)
+{
+    struct gvision_rebuild *rebuild = arg;
+
+    rebuild->table = gvision_build_remap(rebuild->cache_dir,
+                                         &rebuild->format,
+                                         &rebuild->out_format, &rebuild->lens,
+                                         rebuild->mesh_shift, NULL);
+}
+
+/**
+ * Swap a table in between two frames, taking over the reference. Queued
+ * frames hold their own reference to the table they were given.
+ */
+static void gvision_swap_remap(GstGVisionPlugin *filter,
+                               struct remap_table *table,
+                               const struct defisheye_params *lens)
+{
+    release_remap_table(filter->remap);
+    filter->remap      = table;
+    filter->remap_lens = *lens;
+    g_free(filter->remap_file);
+    filter->remap_file = NULL;
+}
+
+/* Keep the table in the cache for a later switch back to its lens */
+static void gvision_cache_remap(GstGVisionPlugin *filter,
+                                struct remap_table *table,
+                                const struct defisheye_params *lens)
+{
+    char key[REMAP_KEY_SIZE];
+
+    if (table) {
+        defisheye_table_key(&filter->format, &filter->out_format, lens,
+                            table->mesh_shift, key);
+        remap_cache_put(filter->tables, key, table);
+    }
+}
+
+/* Wait for a running rebuild and drop its table */
+static void gvision_cancel_rebuild(GstGVisionPlugin *filter)
+{
+    if (filter->rebuild.task) {
+        pool_wait(filter->pool, filter->rebuild.task);
+        filter->rebuild.task = NULL;
+        release_remap_table(filter->rebuild.table);
+        filter->rebuild.table = NULL;
+    }
+}
+
+/* The table of the filter, queued frames keep their own */
+static void gvision_release_remap(GstGVisionPlugin *filter)
+{
+    gvision_cancel_rebuild(filter);
+    release_remap_table(filter->remap);
+    filter->remap          = NULL;
+    g_free(filter->remap_file);
+    filter->remap_file     = NULL;
+}
+
+/**
+ * Follow the lens and map type with the remap table. A table still in the
+ * cache is swapped in at once. Otherwise the first table is built at once,
+ * later ones on a worker while the frames go on with the current table,
+ * and are swapped in at the first frame after they are done if the lens is
+ * still theirs. One rebuild runs at a time, the latest lens is picked up
+ * after it.
+ */
+static void gvision_update_remap(GstGVisionPlugin *filter)
+{
+    struct gvision_rebuild *rebuild = &filter->rebuild;
+    const uint32_t mesh_shift = filter->map_type == MAP_MESH ?
+                                REMAP_MESH_SHIFT : 0;
+    struct defisheye_params lens;
+    struct remap_table *table;
+    char key[REMAP_KEY_SIZE];
+
+    GST_OBJECT_LOCK(filter);
+    lens = filter->lens;
+    GST_OBJECT_UNLOCK(filter);
+
+    if (rebuild->task && pool_ready(rebuild->task)) {
+        pool_wait(filter->pool, rebuild->task);
+        rebuild->task = NULL;
+        gvision_cache_remap(filter, rebuild->table, &rebuild->lens);
+        if (rebuild->mesh_shift == mesh_shift &&
+            !memcmp(&rebuild->lens, &lens, sizeof(lens))) {
+            gvision_swap_remap(filter, rebuild->table, &rebuild->lens);
+        } else {
+            /* The lens moved on meanwhile, only the cache keeps it */
+            release_remap_table(rebuild->table);
+        }
+        rebuild->table = NULL;
+    }
+    if (filter->remap && !filter->remap_file &&
+        filter->remap->mesh_shift == mesh_shift &&
+        !memcmp(&filter->remap_lens, &lens, sizeof(lens))) {
+        return;
+    }
+
+    defisheye_table_key(&filter->format, &filter->out_format, &lens,
+                        mesh_shift, key);
+    table = remap_cache_get(filter->tables, key);
+    if (table) {
+        gvision_swap_remap(filter, table, &lens);
+        return;
+    }
+    if (!filter->remap) {
+        table = gvision_build_remap(filter->cache_dir, &filter->format,
+                                    &filter->out_format, &lens, mesh_shift,
+                                    filter->pool);
+        gvision_cache_remap(filter, table, &lens);
+        gvision_swap_remap(filter, table, &lens);
+        return;
+    }
+    if (rebuild->task) {
+        return;
+    }
+
+    rebuild->format     = filter->format;
+    rebuild->out_format = filter->out_format;
+    rebuild->lens       = lens;
+    rebuild->mesh_shift = mesh_shift;
+    rebuild->cache_dir  = filter->cache_dir;
+    if (pool_size(filter->pool) < 2) {
+        /* No worker to hand it to */
+        gvision_rebuild_job(rebuild, 0, 1, 0);
+        gvision_cache_remap(filter, rebuild->table, &rebuild->lens);
+        gvision_swap_remap(filter, rebuild->table, &rebuild->lens);
+        rebuild->table = NULL;
+    } else {
+        /**
+         * The one chunk falls in the run of the last slot, the one of the
+         * submitter. A worker steals it, or the streaming thread takes it
+         * in pool_wait(). One worker would be the streaming thread itself.
+         */
+        struct pool_job job = {gvision_rebuild_job, rebuild, 0, 1, 1, 0};
+        rebuild->task = pool_submit(filter->pool, &job);
+    }
+}
+
+/**
+ * Follow the map file with the remap table, loaded at once. A lens table
+ * or a rebuild of defisheye mode give way to it. FALSE with an element
+ * error without maps of the output size.
+ */
+static gboolean gvision_update_maps(GstGVisionPlugin *filter)
+{
+    const uint32_t mesh_shift = filter->map_type == MAP_MESH ?
+                                REMAP_MESH_SHIFT : 0;
+    struct remap_table *table;
+    gchar *path;
+
+    GST_OBJECT_LOCK(filter);
+    path = g_strdup(filter->map_file);
+    GST_OBJECT_UNLOCK(filter);
+
+    if (filter->remap && filter->remap->mesh_shift == mesh_shift &&
+        filter->remap_file && !g_strcmp0(path, filter->remap_file)) {
+        g_free(path);
+        return TRUE;
+    }
+    table = path ? load_remap_maps(path, &filter->format,
+                                   &filter->out_format, mesh_shift,
+                                   filter->pool) : NULL;
+    if (!table) {
+        GST_ELEMENT_ERROR(filter, RESOURCE, OPEN_READ,
+                          ("Cannot remap with map-file %s",
+                           path ? path : "(none)"),
+                          ("map-file needs the x then the y positions of the "
+                           "%ux%u output in 32 bit floats",
+                           filter->out_format.width,
+                           filter->out_format.height));
+        g_free(path);
+        return FALSE;
+    }
+
+    gvision_release_remap(filter);
+    filter->remap      = table;
+    filter->remap_file = path;
+    return TRUE;
+}
+
+/* One line per worker and a last one for the streaming threads */
+static gchar *gvision_pool_stats(GstGVisionPlugin *filter)
+{
+    GString *text = g_string_new(NULL);
+
+    if (filter->pool) {
+        unsigned int count = pool_size(filter->pool);
+        struct worker_stats *stats = g_new0(struct worker_stats, count);
+
+        pool_stats(filter->pool, stats, count);
+        for (unsigned int i = 0; i + 1 < count; i++) {
+            double total = stats[i].busy + stats[i].idle + stats[i].wait;
+            g_string_append_printf(text,
+                "worker %u: busy=%.1f%% idle=%.1f%% wait=%.1f%% "
+                "tasks=%" G_GUINT64_FORMAT " chunks=%" G_GUINT64_FORMAT
+                " steals=%" G_GUINT64_FORMAT "\n", i,
+                total > 0.0 ? 100.0 * stats[i].busy / total : 0.0,
+                total > 0.0 ? 100.0 * stats[i].idle / total : 0.0,
+                total > 0.0 ? 100.0 * stats[i].wait / total : 0.0,
+                stats[i].tasks, stats[i].chunks, stats[i].steals);
+        }
+        g_string_append_printf(text,
+            "caller: wait=%.3fms tasks=%" G_GUINT64_FORMAT "\n",
+            stats[count - 1].wait / 1000000.0, stats[count - 1].tasks);
+        g_free(stats);
+    }
+    return g_string_free(text, FALSE);
+}
+
+gboolean gvision_property_mutable(GstElement *element, GParamSpec *pspec)
+{
+    GstState state;
+
+    if (!(pspec->flags & GST_PARAM_MUTABLE_READY)) {
+        return TRUE;
+    }
+
+    GST_OBJECT_LOCK(element);
+    state = MAX(GST_STATE(element), GST_STATE_PENDING(element));
+    GST_OBJECT_UNLOCK(element);
+    if (state > GST_STATE_READY) {
+        GST_WARNING_OBJECT(element, "%s can be set in NULL or READY only",
+                           pspec->name);
+        return FALSE;
     }
-    g_print("Width : %d\nHeight: %d Fmt:%d\n", bfmt.width, bfmt.height,
-            bfmt.pixelformat);
+    return TRUE;
 }
 
 static void
@@ -128,14 +784,155 @@ gst_gvision_plugin_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
 {
   GstGVisionPlugin *filter = GST_GVISION_PLUGIN (object);
+  /* Set by the properties of the pool configuration */
+  gboolean restart = FALSE;
+
+  /* No chain runs in READY, the pool and the frames can go */
+  if (!gvision_property_mutable (GST_ELEMENT (filter), pspec))
+    return;
 
   switch (prop_id) {
     case PROP_SILENT:
       filter->silent = g_value_get_boolean (value);
       break;
+    case PROP_MODE:
+      filter->mode = g_value_get_enum (value);
+      break;
+    case PROP_WHITE_BALANCE:
+      filter->balance = g_value_get_enum (value);
+      break;
+    case PROP_INTERPOLATION:
+      filter->interp = g_value_get_enum (value);
+      break;
+    case PROP_MAP_TYPE:
+      filter->map_type = g_value_get_enum (value);
+      break;
+    case PROP_LENS_MODEL:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.model = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_FOV:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.fov = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_VIEW:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.view = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_ZOOM:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.zoom = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_PAN:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.pan = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_TILT:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.tilt = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_PROJECTION:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.projection = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_SPAN:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.span = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_A:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.a = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_B:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.b = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_C:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.c = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_D:
+      GST_OBJECT_LOCK (filter);
+      filter->lens.d = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_CACHE_DIR:
+      /* The running rebuild reads the directory */
+      gvision_cancel_rebuild (filter);
+      g_free (filter->cache_dir);
+      filter->cache_dir = g_value_dup_string (value);
+      break;
+    case PROP_CACHE_SIZE:
+      filter->cache_size = g_value_get_uint (value);
+      remap_cache_limit (filter->tables, (size_t) filter->cache_size << 20);
+      break;
+    case PROP_MAP_FILE:
+      GST_OBJECT_LOCK (filter);
+      g_free (filter->map_file);
+      filter->map_file = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_THREADS:
+      filter->pool_config.threads = g_value_get_uint (value);
+      restart = TRUE;
+      break;
+    case PROP_CPU_LIST:
+      g_free (filter->pool_config.cpus);
+      filter->pool_config.cpus = g_value_dup_string (value);
+      restart = TRUE;
+      break;
+    case PROP_NUMA_NODE:
+      filter->pool_config.numa_node = g_value_get_int (value);
+      restart = TRUE;
+      break;
+    case PROP_SCHED_POLICY:
+      filter->pool_config.policy = g_value_get_enum (value);
+      restart = TRUE;
+      break;
+    case PROP_SCHED_PRIORITY:
+      filter->pool_config.priority = g_value_get_int (value);
+      restart = TRUE;
+      break;
+    case PROP_SHARED_POOL:
+      filter->pool_config.shared = g_value_get_boolean (value);
+      restart = TRUE;
+      break;
+    case PROP_POOL_PRIORITY:
+      filter->pool_config.stream_priority = g_value_get_int (value);
+      restart = TRUE;
+      break;
+    case PROP_AUTO_TUNE:
+      filter->pool_config.tune = g_value_get_boolean (value);
+      restart = TRUE;
+      break;
+    case PROP_FRAMES_IN_FLIGHT:
+      gvision_drain_frames (filter, FALSE);
+      g_free (filter->frames);
+      filter->frames = NULL;
+      filter->frames_in_flight = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
+      return;
+  }
+
+  if (restart) {
+    /* Not streaming, the pool is started again with the next buffer */
+    gvision_drain_frames (filter, FALSE);
+    gvision_cancel_rebuild (filter);
+    pool_destroy (filter->pool);
+    filter->pool = NULL;
   }
 }
 
@@ -149,28 +946,296 @@ gst_gvision_plugin_get_property (GObject * object, guint prop_id,
     case PROP_SILENT:
       g_value_set_boolean (value, filter->silent);
       break;
+    case PROP_MODE:
+      g_value_set_enum (value, filter->mode);
+      break;
+    case PROP_WHITE_BALANCE:
+      g_value_set_enum (value, filter->balance);
+      break;
+    case PROP_INTERPOLATION:
+      g_value_set_enum (value, filter->interp);
+      break;
+    case PROP_MAP_TYPE:
+      g_value_set_enum (value, filter->map_type);
+      break;
+    case PROP_LENS_MODEL:
+      g_value_set_enum (value, filter->lens.model);
+      break;
+    case PROP_FOV:
+      g_value_set_float (value, filter->lens.fov);
+      break;
+    case PROP_VIEW:
+      g_value_set_float (value, filter->lens.view);
+      break;
+    case PROP_ZOOM:
+      g_value_set_float (value, filter->lens.zoom);
+      break;
+    case PROP_PAN:
+      g_value_set_float (value, filter->lens.pan);
+      break;
+    case PROP_TILT:
+      g_value_set_float (value, filter->lens.tilt);
+      break;
+    case PROP_PROJECTION:
+      g_value_set_enum (value, filter->lens.projection);
+      break;
+    case PROP_SPAN:
+      g_value_set_float (value, filter->lens.span);
+      break;
+    case PROP_A:
+      g_value_set_float (value, filter->lens.a);
+      break;
+    case PROP_B:
+      g_value_set_float (value, filter->lens.b);
+      break;
+    case PROP_C:
+      g_value_set_float (value, filter->lens.c);
+      break;
+    case PROP_D:
+      g_value_set_float (value, filter->lens.d);
+      break;
+    case PROP_CACHE_DIR:
+      g_value_set_string (value, filter->cache_dir);
+      break;
+    case PROP_CACHE_SIZE:
+      g_value_set_uint (value, filter->cache_size);
+      break;
+    case PROP_MAP_FILE:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_string (value, filter->map_file);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_THREADS:
+      g_value_set_uint (value, filter->pool_config.threads);
+      break;
+    case PROP_CPU_LIST:
+      g_value_set_string (value, filter->pool_config.cpus);
+      break;
+    case PROP_NUMA_NODE:
+      g_value_set_int (value, filter->pool_config.numa_node);
+      break;
+    case PROP_SCHED_POLICY:
+      g_value_set_enum (value, filter->pool_config.policy);
+      break;
+    case PROP_SCHED_PRIORITY:
+      g_value_set_int (value, filter->pool_config.priority);
+      break;
+    case PROP_SHARED_POOL:
+      g_value_set_boolean (value, filter->pool_config.shared);
+      break;
+    case PROP_POOL_PRIORITY:
+      g_value_set_int (value, filter->pool_config.stream_priority);
+      break;
+    case PROP_FRAMES_IN_FLIGHT:
+      g_value_set_uint (value, filter->frames_in_flight);
+      break;
+    case PROP_AUTO_TUNE:
+      g_value_set_boolean (value, filter->pool_config.tune);
+      break;
+    case PROP_STATS:
+      g_value_take_string (value, gvision_pool_stats (filter));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+static void
+gst_gvision_plugin_finalize (GObject * object)
+{
+  GstGVisionPlugin *filter = GST_GVISION_PLUGIN (object);
+
+  gvision_drain_frames(filter, FALSE);
+  g_free(filter->frames);
+  filter->frames = NULL;
+  gvision_release_remap(filter);
+  release_remap_cache(filter->tables);
+  filter->tables = NULL;
+  g_free(filter->cache_dir);
+  filter->cache_dir = NULL;
+  g_free(filter->map_file);
+  filter->map_file = NULL;
+
+  pool_destroy(filter->pool);
+  filter->pool = NULL;
+  g_free(filter->pool_config.cpus);
+  filter->pool_config.cpus = NULL;
+
+  release_levels_state(filter->levels);
+  filter->levels = NULL;
+  release_duration_hashmaps();
+
+  gvision_release_output_pool(filter);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static GstStateChangeReturn
+gst_gvision_plugin_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstGVisionPlugin *filter = GST_GVISION_PLUGIN (element);
+  GstStateChangeReturn ret;
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+  if (ret == GST_STATE_CHANGE_FAILURE)
+    return ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* The pads are deactivated, no frame can come in anymore */
+      gvision_drain_frames (filter, FALSE);
+      gvision_cancel_rebuild (filter);
+      break;
+    default:
+      break;
+  }
+  return ret;
+}
+
+GstCaps *gvision_any_size(GstCaps *caps)
+{
+    GstCaps *res = gst_caps_copy(caps);
+
+    for (guint i = 0; i < gst_caps_get_size(res); i++) {
+        gst_structure_set(gst_caps_get_structure(res, i),
+                          "width", GST_TYPE_INT_RANGE, 1, G_MAXINT,
+                          "height", GST_TYPE_INT_RANGE, 1, G_MAXINT, NULL);
+    }
+    return res;
+}
+
+GstCaps *gvision_output_caps(GstPad *srcpad, GstCaps *caps)
+{
+    const GstStructure *in = gst_caps_get_structure(caps, 0);
+    GstCaps *any = gvision_any_size(caps);
+    GstCaps *out = gst_pad_peer_query_caps(srcpad, any);
+    GstStructure *str;
+    gint width, height;
+
+    gst_caps_unref(any);
+    if (gst_caps_is_empty(out) ||
+        !gst_structure_get_int(in, "width", &width) ||
+        !gst_structure_get_int(in, "height", &height)) {
+        gst_caps_unref(out);
+        return NULL;
+    }
+    out = gst_caps_make_writable(gst_caps_truncate(out));
+    str = gst_caps_get_structure(out, 0);
+    gst_structure_fixate_field_nearest_int(str, "width", width);
+    gst_structure_fixate_field_nearest_int(str, "height", height);
+    return gst_caps_fixate(out);
+}
+
+/**
+ * Caps of both pads are those of the peer of the other pad, in any frame
+ * size in defisheye mode
+ */
+static gboolean
+gst_gvision_plugin_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  GstGVisionPlugin *filter = GST_GVISION_PLUGIN (parent);
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CAPS:
+    {
+        GstPad *other = pad == filter->sinkpad ? filter->srcpad :
+                                                 filter->sinkpad;
+        GstCaps *filt, *caps, *templ, *result;
+
+        gst_query_parse_caps (query, &filt);
+        if (gvision_out_of_place(filter->mode)) {
+            GstCaps *any = filt ? gvision_any_size (filt) : NULL;
+            GstCaps *peer = gst_pad_peer_query_caps (other, any);
+            caps = gvision_any_size (peer);
+            gst_caps_unref (peer);
+            if (any) {
+                gst_caps_unref (any);
+            }
+        } else {
+            caps = gst_pad_peer_query_caps (other, filt);
+        }
+        templ  = gst_pad_get_pad_template_caps (pad);
+        result = gst_caps_intersect (caps, templ);
+        gst_caps_unref (templ);
+        gst_caps_unref (caps);
+        if (filt) {
+            caps = gst_caps_intersect_full (filt, result,
+                                            GST_CAPS_INTERSECT_FIRST);
+            gst_caps_unref (result);
+            result = caps;
+        }
+        gst_query_set_caps_result (query, result);
+        gst_caps_unref (result);
+        return TRUE;
+    }
+    case GST_QUERY_ACCEPT_CAPS:
+    {
+        GstCaps *caps, *allowed;
+
+        gst_query_parse_accept_caps (query, &caps);
+        allowed = gst_pad_query_caps (pad, caps);
+        gst_query_set_accept_caps_result (query,
+            gst_caps_can_intersect (caps, allowed));
+        gst_caps_unref (allowed);
+        return TRUE;
+    }
+    default:
+        return gst_pad_query_default (pad, parent, query);
+  }
+}
+
 /* this function handles sink events */
 static gboolean
 gst_gvision_plugin_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
 {
+  GstGVisionPlugin *filter = GST_GVISION_PLUGIN (parent);
+
   switch (GST_EVENT_TYPE (event)) {
     case GST_EVENT_FLUSH_START:
         fprintf(stderr, "data is to be discarded\n");
         break;
     case GST_EVENT_FLUSH_STOP:
         fprintf(stderr, "data is allowed again\n");
+        /* Streaming thread is stopped, queued frames are stale */
+        gvision_drain_frames(filter, FALSE);
         break;
     case GST_EVENT_CAPS:
     {
         GstCaps * caps;
         gst_event_parse_caps (event, &caps);
-        /* do something with the caps */
+        /* Frames of the previous format go out first */
+        gvision_drain_frames(filter, TRUE);
+        gvision_get_video_caps(&filter->format, caps);
+        /* The remap table and output buffers follow the frame size */
+        gvision_release_remap(filter);
+        gvision_release_output_pool(filter);
+
+        filter->out_format = filter->format;
+        if (gvision_out_of_place(filter->mode)) {
+            /* Scaled in the same pass to the size downstream takes */
+            GstCaps *out = gvision_output_caps(filter->srcpad, caps);
+
+            gst_event_unref(event);
+            if (!out) {
+                GST_ERROR("No output caps downstream accepts");
+                return FALSE;
+            }
+            gvision_get_video_caps(&filter->out_format, out);
+            if (filter->mode == MODE_REMAP) {
+                /* Maps of another size fail the negotiation */
+                if (!filter->pool) {
+                    filter->pool = pool_create(&filter->pool_config);
+                }
+                if (!gvision_update_maps(filter)) {
+                    gst_caps_unref(out);
+                    return FALSE;
+                }
+            }
+            event = gst_event_new_caps(out);
+            gst_caps_unref(out);
+        }
 
         /* and forward */
         fprintf(stderr, "Format information about the following buffers\n");
@@ -190,9 +1255,8 @@ gst_gvision_plugin_sink_event (GstPad * pad, GstObject * parent, GstEvent * even
         break;
     case GST_EVENT_EOS:
         fprintf(stderr, "no more data is to be expected on a pad.\n");
-        release_histogram_pdf_mt();
-        release_histogram_array(HIST_COUNT);
-        release_duration_hashmaps();
+        /* Queued frames go out ahead of the EOS */
+        gvision_drain_frames(filter, TRUE);
         fprintf(stderr, "done\n");
         break;
     case GST_EVENT_QOS:
@@ -230,37 +1294,57 @@ gst_gvision_plugin_chain(GstPad * pad, GstObject * parent, GstBuffer * buf)
     GstGVisionPlugin *filter = GST_GVISION_PLUGIN (parent);
     GstBuffer *buffer = buf;
 
-    if (gplot_hd) {
-        if (!bfmt.width || !bfmt.height) {
-            GstCaps *vcaps = gst_pad_get_current_caps(pad);
-            if (vcaps) {
-                gvision_get_video_caps(vcaps);
-                if (filter->silent == FALSE) {
-                    g_print("GenVision plugged\n");
-                }
-            } else {
-                g_print("Cannot get video properties\n");
+    /* Controlled lens properties take their values at the frame time */
+    if (GST_BUFFER_PTS_IS_VALID(buf)) {
+        gst_object_sync_values(GST_OBJECT(filter), GST_BUFFER_PTS(buf));
+    }
+
+    if (!filter->format.width || !filter->format.height) {
+        GstCaps *vcaps = gst_pad_get_current_caps(pad);
+        if (vcaps) {
+            gvision_get_video_caps(&filter->format, vcaps);
+            filter->out_format = filter->format;
+            gst_caps_unref(vcaps);
+            if (filter->silent == FALSE) {
+                g_print("GenVision plugged\n");
             }
+        } else {
+            g_print("Cannot get video properties\n");
         }
+    }
 
-        if (bfmt.width && bfmt.height && buffer) {
-            /* Mapping a buffer */
-            GstMapInfo map;
-            if (gst_buffer_map(buf, &map, GST_MAP_WRITE)) {
-#if 1
-                uint8_t* pixels = map.data;
-                if (pixels) {
-                    equalize_histogram(pixels, &bfmt);
-                }
-#else
-                /* Rectify distortion */
-                calculate_defisheye(map.data, map.size, &bfmt);
-#endif
+    if (filter->format.width && filter->format.height && buffer) {
+        struct gvision_frame frame;
+        if (!filter->pool) {
+            filter->pool = pool_create(&filter->pool_config);
+        }
+        if (filter->mode == MODE_DEFISHEYE) {
+            gvision_update_remap(filter);
+        } else if (filter->mode == MODE_REMAP) {
+            /* Loaded with the caps, or map-file changed since */
+            if (!gvision_update_maps(filter)) {
+                gst_buffer_unref(buf);
+                return GST_FLOW_ERROR;
             }
-            gst_buffer_unmap(buf, &map);
+        } else if (filter->out_format.width != filter->format.width ||
+                   filter->out_format.height != filter->format.height) {
+            /* Only defisheye scales, the caps were for it */
+            GST_ERROR("Mode changed on a scaling stream");
+            gst_buffer_unref(buf);
+            return GST_FLOW_NOT_NEGOTIATED;
+        }
+        if (filter->frames_in_flight > 1) {
+            /* Several frames at once, one per worker */
+            return gvision_queue_frame(filter, buf);
+        }
+        if (gvision_map_frame(filter, &frame, buf)) {
+            gvision_process(&frame, filter->pool);
+            buf = gvision_unmap_frame(&frame);
+        } else if (gvision_out_of_place(frame.mode)) {
+            return gvision_map_error(filter, &frame);
         }
     }
-    /* just push out the incoming buffer without touching it */
+    /* The input, or the new buffer of an out of place mode */
     return gst_pad_push(filter->srcpad, buf);
 }
 
@@ -276,11 +1360,186 @@ gst_gvision_plugin_class_init (GstGVisionPluginClass * klass)
 
   gobject_class->set_property = gst_gvision_plugin_set_property;
   gobject_class->get_property = gst_gvision_plugin_get_property;
+  gobject_class->finalize = gst_gvision_plugin_finalize;
+
+  gstelement_class->change_state =
+      GST_DEBUG_FUNCPTR (gst_gvision_plugin_change_state);
 
   g_object_class_install_property (gobject_class, PROP_SILENT,
       g_param_spec_boolean ("silent", "Silent", "Produce verbose output ?",
           FALSE, G_PARAM_READWRITE));
 
+  g_object_class_install_property (gobject_class, PROP_MODE,
+      g_param_spec_enum ("mode", "Mode", "Image processing to apply",
+          GST_TYPE_GVISION_MODE, MODE_EQUALIZE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_WHITE_BALANCE,
+      g_param_spec_enum ("white-balance", "White balance",
+          "White balance of RGB frames, estimated in the histogram pass",
+          GST_TYPE_GVISION_WHITE_BALANCE, WB_NONE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_INTERPOLATION,
+      g_param_spec_enum ("interpolation", "Interpolation",
+          "Sampling of the source image by defisheye",
+          GST_TYPE_GVISION_INTERPOLATION, INTERP_BILINEAR,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_MAP_TYPE,
+      g_param_spec_enum ("map-type", "Map type",
+          "Storage of the defisheye table, mesh trades accuracy for memory",
+          GST_TYPE_GVISION_MAP_TYPE, MAP_FULL, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_LENS_MODEL,
+      g_param_spec_enum ("lens-model", "Lens model",
+          "Barrel polynomial or fisheye projection corrected by defisheye",
+          GST_TYPE_GVISION_LENS_MODEL, LENS_POLYNOMIAL, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_FOV,
+      g_param_spec_float ("fov", "Field of view",
+          "Degrees the fisheye lens covers across the short side of the frame",
+          1.0f, 359.0f, DEFISHEYE_FOV, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_VIEW,
+      g_param_spec_float ("view", "View",
+          "Degrees of the rectilinear output across the short side",
+          1.0f, 179.0f, DEFISHEYE_VIEW, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_ZOOM,
+      g_param_spec_float ("zoom", "Zoom",
+          "Magnification of the corrected frame, cropped around the centre "
+          "to the output size",
+          0.25f, 16.0f, DEFISHEYE_ZOOM,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_PAN,
+      g_param_spec_float ("pan", "Pan",
+          "Degrees the view is turned around the lens axis",
+          -180.0f, 180.0f, DEFISHEYE_PAN,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_TILT,
+      g_param_spec_float ("tilt", "Tilt",
+          "Degrees the view is turned away from the lens axis, the "
+          "polynomial model turns as equidistant",
+          -180.0f, 180.0f, DEFISHEYE_TILT,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_PROJECTION,
+      g_param_spec_enum ("projection", "Projection",
+          "Rectilinear view or panorama unwrapped around the lens axis, the "
+          "polynomial model unwraps as equidistant",
+          GST_TYPE_GVISION_PROJECTION, PROJECTION_RECTILINEAR,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_SPAN,
+      g_param_spec_float ("span", "Span",
+          "Degrees around the lens axis across the width of a panorama, "
+          "centred on the pan",
+          1.0f, 360.0f, DEFISHEYE_SPAN,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_A,
+      g_param_spec_float ("a", "a",
+          "Polynomial lens coefficient of r^3, the outermost pixels",
+          -10.0f, 10.0f, DEFISHEYE_A,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_B,
+      g_param_spec_float ("b", "b",
+          "Polynomial lens coefficient of r^2, most lenses need only this one",
+          -10.0f, 10.0f, DEFISHEYE_B,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_C,
+      g_param_spec_float ("c", "c",
+          "Polynomial lens coefficient of r, a uniform correction",
+          -10.0f, 10.0f, DEFISHEYE_C,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_D,
+      g_param_spec_float ("d", "d",
+          "Polynomial lens scaling, a + b + c + d = 1 keeps the size",
+          -10.0f, 10.0f, DEFISHEYE_D,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_CACHE_DIR,
+      g_param_spec_string ("cache-dir", "Cache directory",
+          "Directory of stored remap tables, mapped and shared between "
+          "processes, none to build them on every start",
+          NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_CACHE_SIZE,
+      g_param_spec_uint ("cache-size", "Cache size",
+          "MiB of recently used remap tables kept in memory, switching back "
+          "to their lens needs no rebuild, 0 to keep none",
+          0, 1U << 16, GVISION_CACHE_SIZE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_MAP_FILE,
+      g_param_spec_string ("map-file", "Map file",
+          "Maps of remap mode in the output size, the source x positions of "
+          "all pixels then their y positions in 32 bit floats, as the OpenCV "
+          "mapx and mapy",
+          NULL, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_THREADS,
+      g_param_spec_uint ("threads", "Threads",
+          "Worker threads including the streaming one, 0 for one per CPU",
+          0, CPU_SETSIZE, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_CPU_LIST,
+      g_param_spec_string ("cpu-list", "CPU list",
+          "CPUs to pin the workers to, one each, e.g. \"0-3,8\"",
+          NULL, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_NUMA_NODE,
+      g_param_spec_int ("numa-node", "NUMA node",
+          "Pin the workers to the CPUs of the node when cpu-list is not set, "
+          "-1 for no pinning",
+          -1, G_MAXINT, -1, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_SCHED_POLICY,
+      g_param_spec_enum ("sched-policy", "Scheduling policy",
+          "Scheduling policy of the workers",
+          GST_TYPE_GVISION_SCHED_POLICY, POLICY_OTHER,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_SCHED_PRIORITY,
+      g_param_spec_int ("sched-priority", "Scheduling priority",
+          "Nice value for the other policy, 1..99 for fifo",
+          -20, 99, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_SHARED_POOL,
+      g_param_spec_boolean ("shared-pool", "Shared pool",
+          "Run on the worker threads shared by all elements of the process, "
+          "the first one sets them up",
+          FALSE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_POOL_PRIORITY,
+      g_param_spec_int ("pool-priority", "Pool priority",
+          "Shared workers take jobs of higher priority streams first",
+          G_MININT, G_MAXINT, 0,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_FRAMES_IN_FLIGHT,
+      g_param_spec_uint ("frames-in-flight", "Frames in flight",
+          "Frames processed concurrently, one per worker, and pushed in "
+          "order. 1 splits every frame over the workers instead",
+          1, GVISION_MAX_FRAMES, 1,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_AUTO_TUNE,
+      g_param_spec_boolean ("auto-tune", "Auto tune",
+          "Pick threads and band sizes of every stage from measured times, "
+          "down to a single thread for small frames",
+          TRUE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_string ("stats", "Statistics",
+          "Share of time every worker was busy, idle and spinning for work, "
+          "with the tasks, chunks and stolen chunks it ran, since the start",
+          NULL, G_PARAM_READABLE));
+
   gst_element_class_set_details_simple(gstelement_class,
     "Image processing",
     "Filter/Converter/Video",
@@ -306,20 +1565,44 @@ gst_gvision_plugin_init (GstGVisionPlugin * filter)
                               GST_DEBUG_FUNCPTR(gst_gvision_plugin_sink_event));
   gst_pad_set_chain_function (filter->sinkpad,
                               GST_DEBUG_FUNCPTR(gst_gvision_plugin_chain));
-  GST_PAD_SET_PROXY_CAPS (filter->sinkpad);
+  gst_pad_set_query_function (filter->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_gvision_plugin_query));
   gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
 
   filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
-  GST_PAD_SET_PROXY_CAPS (filter->srcpad);
+  gst_pad_set_query_function (filter->srcpad,
+                              GST_DEBUG_FUNCPTR(gst_gvision_plugin_query));
   gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
 
-  filter->silent = FALSE;
+  filter->silent  = FALSE;
+  filter->mode    = MODE_EQUALIZE;
+  filter->balance = WB_NONE;
+  memset(&filter->format, 0, sizeof(filter->format));
+  memset(&filter->out_format, 0, sizeof(filter->out_format));
+  filter->levels  = prepare_levels_state();
+  defisheye_default_params(&filter->lens);
+  filter->interp  = INTERP_BILINEAR;
+  filter->map_type = MAP_FULL;
+  filter->remap   = NULL;
+  filter->cache_dir = NULL;
+  filter->map_file = NULL;
+  filter->remap_file = NULL;
+  memset(&filter->rebuild, 0, sizeof(filter->rebuild));
+  filter->cache_size = GVISION_CACHE_SIZE;
+  filter->tables  = prepare_remap_cache((size_t) filter->cache_size << 20);
+  filter->out_pool = NULL;
 
+  /* Released in finalize, other instances may still use it */
   prepare_duration_hashmaps(8192);
 
-  prepare_histogram_array(HIST_COUNT);
+  /* Started with the first buffer, once the properties are set */
+  pool_default_config(&filter->pool_config);
+  filter->pool = NULL;
 
-  prepare_histogram_pdf_mt();
+  filter->frames_in_flight = 1;
+  filter->frames      = NULL;
+  filter->frame_head  = 0;
+  filter->frame_count = 0;
 
   gplot_hd = gnuplot_init() ;
 }
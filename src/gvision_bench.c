@@ -0,0 +1,555 @@
+/**
+ * Copyright (c) 2017 Atanas Filipov <it.feel.filipov@gmail.com>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * Stand-alone benchmark of the processing kernels on synthetic frames.
+ *
+ * Build and run:
+ *   make TARGET=gvision_bench
+ *   ./bin/gvision_bench [width height [frames]]
+ */
+
+#include "gvision_base.h"
+#include "gvision_multithread.h"
+#include "histogram/gvision_histogram.h"
+#include "defisheye/gvision_defisheye.h"
+#include "duration/gvision_duration.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define BENCH_WIDTH  1280U
+#define BENCH_HEIGHT 720U
+#define BENCH_FRAMES 100U
+#define BENCH_ROUNDS 10000U
+#define BENCH_VIEWS  4U
+
+struct bench_args {
+    struct levels_state* levels;
+    enum white_balance balance;
+    struct worker_pool* pool;
+    /* Out of place kernels */
+    const struct remap_table* remap;
+    enum interpolation interp;
+    uint8_t* out;
+    /* Format of out, NULL for the input one */
+    const struct image_format* out_fmt;
+    /* Several outputs of the same frame */
+    const struct remap_view* views;
+    unsigned int count;
+};
+
+typedef void (*bench_func_t)(uint8_t* buf, const struct image_format* fmt,
+                             void* arg);
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Low contrast gradient with some noise, refreshed before every frame */
+static void fill_frame(uint8_t* buf, const struct image_format* fmt,
+                       unsigned int seed)
+{
+    srandom(seed);
+    for (uint32_t h = 0; h < fmt->height; h++) {
+        for (uint32_t w = 0; w < fmt->bytesperline; w++) {
+            buf[h * fmt->bytesperline + w] = 64 + (w + h) % 96 +
+                                             random() % 16;
+        }
+    }
+}
+
+static void run_bench(const char* name, bench_func_t func, void* arg,
+                      const struct image_format* fmt, unsigned int frames)
+{
+    uint8_t* buf = malloc(fmt->size * 3 / 2);
+    double total = 0;
+
+    if (!buf) {
+        fprintf(stderr, "Cannot allocate benchmark frame\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < frames; i++) {
+        fill_frame(buf, fmt, i);
+        double start = now_ms();
+        func(buf, fmt, arg);
+        total += now_ms() - start;
+    }
+    printf("%-24s %ux%u %s: %8.3f ms/frame\n", name, fmt->width, fmt->height,
+           fmt->pixelformat == PIXEL_YV12 ? "YV12" : "RGB ", total / frames);
+
+    free(buf);
+}
+
+static void bench_equalize(uint8_t* buf, const struct image_format* fmt,
+                           void* arg)
+{
+    struct bench_args* args = arg;
+    equalize_histogram(buf, fmt, args->levels, args->balance, args->pool);
+}
+
+static void bench_autolevels(uint8_t* buf, const struct image_format* fmt,
+                             void* arg)
+{
+    struct bench_args* args = arg;
+    autolevels_histogram(buf, fmt, args->levels, args->balance, args->pool);
+}
+
+static void bench_defisheye(uint8_t* buf, const struct image_format* fmt,
+                            void* arg)
+{
+    struct bench_args* args = arg;
+    calculate_defisheye(buf, args->out, fmt,
+                        args->out_fmt ? args->out_fmt : fmt, args->remap,
+                        args->interp, args->pool);
+}
+
+/* Defisheye at every interpolation, tables built for the format */
+static void run_defisheye(struct bench_args* args,
+                          const struct image_format* fmt, unsigned int frames)
+{
+    static const char* names[] = {
+        "defisheye nearest", "defisheye bilinear", "defisheye bicubic"
+    };
+    static const char* models[] = {
+        NULL, "equidistant table", "equisolid table", "stereographic table",
+        "orthographic table"
+    };
+    struct defisheye_params params;
+    struct remap_table* table;
+
+    defisheye_default_params(&params);
+    double start = now_ms();
+    table = prepare_defisheye_table(fmt, fmt, &params, 0, args->pool);
+    printf("%-24s %ux%u     : %8.3f ms\n", "defisheye table", fmt->width,
+           fmt->height, now_ms() - start);
+
+    /* Projection models only differ in the table build */
+    for (unsigned int i = LENS_EQUIDISTANT; i <= LENS_ORTHOGRAPHIC; i++) {
+        struct defisheye_params lens = params;
+        lens.model = i;
+        start = now_ms();
+        struct remap_table* other = prepare_defisheye_table(fmt, fmt, &lens,
+                                                            0, args->pool);
+        printf("%-24s %ux%u     : %8.3f ms\n", models[i], fmt->width,
+               fmt->height, now_ms() - start);
+        release_remap_table(other);
+    }
+
+    /* Switching back to a lens still in memory */
+    struct remap_cache* cache = prepare_remap_cache(SIZE_MAX);
+    char key[REMAP_KEY_SIZE];
+    defisheye_table_key(fmt, fmt, &params, 0, key);
+    remap_cache_put(cache, key, table);
+    start = now_ms();
+    struct remap_table* cached = remap_cache_get(cache, key);
+    printf("%-24s %ux%u     : %8.3f ms\n", "defisheye cached table",
+           fmt->width, fmt->height, now_ms() - start);
+    release_remap_table(cached);
+    release_remap_cache(cache);
+
+    args->remap = table;
+    args->out   = malloc(fmt->size * 3 / 2);
+    if (!args->out) {
+        fprintf(stderr, "Cannot allocate benchmark frame\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = INTERP_NEAREST; i <= INTERP_BICUBIC; i++) {
+        args->interp = i;
+        run_bench(names[i], bench_defisheye, args, fmt, frames);
+    }
+    free(args->out);
+    args->out = NULL;
+    release_remap_table(table);
+}
+
+/**
+ * Mesh against the full table: build time, memory, speed and the error of
+ * the interpolated positions and of the output
+ */
+static void run_mesh(struct bench_args* args, const struct image_format* fmt,
+                     unsigned int frames)
+{
+    struct defisheye_params params;
+    struct remap_table* full;
+    struct remap_table* mesh;
+    uint8_t* src = malloc(fmt->size * 3 / 2);
+    uint8_t* ref = malloc(fmt->size * 3 / 2);
+    double error = 0, worst = 0;
+    unsigned int diff = 0;
+
+    if (!src || !ref) {
+        fprintf(stderr, "Cannot allocate benchmark frame\n");
+        exit(EXIT_FAILURE);
+    }
+
+    defisheye_default_params(&params);
+    full = prepare_defisheye_table(fmt, fmt, &params, 0, args->pool);
+    double start = now_ms();
+    mesh = prepare_defisheye_table(fmt, fmt, &params, REMAP_MESH_SHIFT,
+                                   args->pool);
+    printf("%-24s %ux%u     : %8.3f ms, %zu of %zu bytes\n", "defisheye mesh",
+           fmt->width, fmt->height, now_ms() - start, remap_table_size(mesh),
+           remap_table_size(full));
+
+    for (uint32_t y = 0; y < fmt->height; y++) {
+        for (uint32_t x = 0; x < fmt->width; x++) {
+            struct remap_coord a, b;
+            remap_lookup(full, x, y, &a);
+            remap_lookup(mesh, x, y, &b);
+            double d = hypot(a.x - b.x, a.y - b.y) / REMAP_ONE;
+            error += d;
+            worst  = d > worst ? d : worst;
+        }
+    }
+    printf("%-24s %ux%u     : %8.4f px mean, %8.4f px max\n", "mesh position",
+           fmt->width, fmt->height, error / ((double)fmt->width * fmt->height),
+           worst);
+
+    fill_frame(src, fmt, 0);
+    calculate_defisheye(src, ref, fmt, fmt, full, INTERP_BILINEAR,
+                        args->pool);
+    args->out = malloc(fmt->size * 3 / 2);
+    if (!args->out) {
+        fprintf(stderr, "Cannot allocate benchmark frame\n");
+        exit(EXIT_FAILURE);
+    }
+    calculate_defisheye(src, args->out, fmt, fmt, mesh, INTERP_BILINEAR,
+                        args->pool);
+    for (uint32_t i = 0; i < fmt->size; i++) {
+        diff = max(diff, (unsigned int)abs(ref[i] - args->out[i]));
+    }
+    printf("%-24s %ux%u     : %8u max\n", "mesh output", fmt->width,
+           fmt->height, diff);
+
+    args->remap = mesh;
+    args->interp = INTERP_NEAREST;
+    run_bench("defisheye mesh nearest", bench_defisheye, args, fmt, frames);
+    args->interp = INTERP_BILINEAR;
+    run_bench("defisheye mesh bilinear", bench_defisheye, args, fmt, frames);
+
+    free(args->out);
+    args->out = NULL;
+    release_remap_table(mesh);
+    release_remap_table(full);
+    free(ref);
+    free(src);
+}
+
+/**
+ * Defisheye scaled down to a third in the same pass, the table averaging
+ * the source pixels of every output pixel. Timed against the input size
+ * frame, the pass a separate scaler would follow.
+ */
+static void run_scale(struct bench_args* args, const struct image_format* fmt,
+                      unsigned int frames)
+{
+    struct image_format out = *fmt;
+    struct defisheye_params params;
+    struct remap_table* table;
+
+    out.width  = fmt->width  / 3;
+    out.height = fmt->height / 3;
+    out.bytesperline = fmt->bytesperline / fmt->width * out.width;
+    out.size   = out.height * out.bytesperline;
+
+    defisheye_default_params(&params);
+    double start = now_ms();
+    table = prepare_defisheye_table(fmt, &out, &params, 0, args->pool);
+    printf("%-24s %ux%u     : %8.3f ms, %u samples\n", "defisheye scaled table",
+           out.width, out.height, now_ms() - start,
+           1U << (2 * table->sample_shift));
+
+    args->remap   = table;
+    args->out_fmt = &out;
+    args->out     = malloc(out.size * 3 / 2);
+    if (!args->out) {
+        fprintf(stderr, "Cannot allocate benchmark frame\n");
+        exit(EXIT_FAILURE);
+    }
+    args->interp = INTERP_NEAREST;
+    run_bench("defisheye scaled nearest", bench_defisheye, args, fmt, frames);
+    args->interp = INTERP_BILINEAR;
+    run_bench("defisheye scaled bilinear", bench_defisheye, args, fmt,
+              frames);
+
+    free(args->out);
+    args->out     = NULL;
+    args->out_fmt = NULL;
+    release_remap_table(table);
+}
+
+/* 360 degree panoramas a third of the input high, both projections */
+static void run_panorama(struct bench_args* args,
+                         const struct image_format* fmt, unsigned int frames)
+{
+    static const char* names[] = {NULL, "cylindrical panorama",
+                                  "equirectangular panorama"};
+    struct image_format out = *fmt;
+    struct defisheye_params params;
+
+    out.height = fmt->height / 3;
+    out.size   = out.height * out.bytesperline;
+    args->out_fmt = &out;
+    args->out     = malloc(out.size * 3 / 2);
+    if (!args->out) {
+        fprintf(stderr, "Cannot allocate benchmark frame\n");
+        exit(EXIT_FAILURE);
+    }
+
+    defisheye_default_params(&params);
+    params.model = LENS_EQUIDISTANT;
+    for (unsigned int p = PROJECTION_CYLINDRICAL;
+         p <= PROJECTION_EQUIRECTANGULAR; p++) {
+        struct remap_table* table;
+
+        params.projection = p;
+        table = prepare_defisheye_table(fmt, &out, &params, 0, args->pool);
+        args->remap  = table;
+        args->interp = INTERP_BILINEAR;
+        run_bench(names[p], bench_defisheye, args, fmt, frames);
+        release_remap_table(table);
+    }
+
+    free(args->out);
+    args->remap   = NULL;
+    args->out     = NULL;
+    args->out_fmt = NULL;
+}
+
+static void bench_views(uint8_t* buf, const struct image_format* fmt,
+                        void* arg)
+{
+    struct bench_args* args = arg;
+    remap_frames(args->views, args->count, buf, fmt, args->interp,
+                 args->pool);
+}
+
+static void bench_views_apart(uint8_t* buf, const struct image_format* fmt,
+                              void* arg)
+{
+    struct bench_args* args = arg;
+    for (unsigned int v = 0; v < args->count; v++) {
+        remap_frame(args->views[v].table, buf, args->views[v].dst, fmt,
+                    args->views[v].out, args->interp, args->pool);
+    }
+}
+
+/**
+ * Virtual PTZ views around a ceiling fisheye, a quarter of the input each
+ * and zoomed in, gathered in one pass against one pass per view
+ */
+static void run_views(struct bench_args* args, const struct image_format* fmt,
+                      unsigned int frames)
+{
+    struct image_format out = *fmt;
+    struct remap_table* tables[BENCH_VIEWS];
+    struct remap_view views[BENCH_VIEWS];
+    struct defisheye_params params;
+
+    out.width  = fmt->width  / 2;
+    out.height = fmt->height / 2;
+    out.bytesperline = fmt->bytesperline / fmt->width * out.width;
+    out.size   = out.height * out.bytesperline;
+
+    defisheye_default_params(&params);
+    params.model = LENS_EQUIDISTANT;
+    params.tilt  = 45.0f;
+    params.zoom  = 2.0f;
+    for (unsigned int v = 0; v < BENCH_VIEWS; v++) {
+        params.pan = 360.0f * v / BENCH_VIEWS;
+        tables[v] = prepare_defisheye_table(fmt, &out, &params,
+                                            REMAP_MESH_SHIFT, args->pool);
+        views[v].table = tables[v];
+        views[v].dst   = malloc(out.size * 3 / 2);
+        views[v].out   = &out;
+        if (!views[v].dst) {
+            fprintf(stderr, "Cannot allocate benchmark frame\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    args->views  = views;
+    args->count  = BENCH_VIEWS;
+    args->interp = INTERP_BILINEAR;
+    run_bench("ptz views one pass", bench_views, args, fmt, frames);
+    run_bench("ptz views apart", bench_views_apart, args, fmt, frames);
+
+    for (unsigned int v = 0; v < BENCH_VIEWS; v++) {
+        release_remap_table(tables[v]);
+        free(views[v].dst);
+    }
+    args->views = NULL;
+    args->count = 0;
+}
+
+struct bench_frame {
+    uint8_t* buf;
+    const struct image_format* fmt;
+    bench_func_t func;
+    struct bench_args args;
+};
+
+static void frame_job(void* arg, uint32_t begin, uint32_t end,
+                      unsigned int worker)
+{
+    struct bench_frame* frame = arg;
+    frame->func(frame->buf, frame->fmt, &frame->args);
+}
+
+/* Frame level parallelism, one frame per thread, retired in order */
+static void run_frames(const char* name, bench_func_t func,
+                       const struct bench_args* args,
+                       const struct image_format* fmt, unsigned int frames)
+{
+    unsigned int window = pool_size(args->pool);
+    struct bench_frame slots[window];
+    struct pool_task* tasks[window];
+    unsigned int head = 0, count = 0;
+
+    for (unsigned int i = 0; i < window; i++) {
+        slots[i].buf  = malloc(fmt->size * 3 / 2);
+        slots[i].fmt  = fmt;
+        slots[i].func = func;
+        slots[i].args = *args;
+        /* Kernels run serially inside a frame */
+        slots[i].args.pool = NULL;
+        if (!slots[i].buf) {
+            fprintf(stderr, "Cannot allocate benchmark frame\n");
+            exit(EXIT_FAILURE);
+        }
+        fill_frame(slots[i].buf, fmt, i);
+    }
+
+    double start = now_ms();
+    for (unsigned int i = 0; i < frames + window; i++) {
+        if (count == window || (i >= frames && count)) {
+            pool_wait(args->pool, tasks[head]);
+            head = (head + 1) % window;
+            count--;
+        }
+        if (i < frames) {
+            unsigned int slot = (head + count++) % window;
+            struct pool_job job = {frame_job, &slots[slot], 0, 1, 1, 0};
+            tasks[slot] = pool_submit(args->pool, &job);
+        }
+    }
+    printf("%-24s %ux%u %s: %8.3f ms/frame\n", name, fmt->width, fmt->height,
+           fmt->pixelformat == PIXEL_YV12 ? "YV12" : "RGB ",
+           (now_ms() - start) / frames);
+
+    for (unsigned int i = 0; i < window; i++) {
+        free(slots[i].buf);
+    }
+}
+
+static void empty_job(void* arg, uint32_t begin, uint32_t end,
+                      unsigned int worker)
+{
+}
+
+/* Round trip of a job which has one empty chunk per thread */
+static void run_dispatch(struct worker_pool* pool, unsigned int rounds)
+{
+    struct pool_job job = {empty_job, NULL, 0, pool_size(pool), 1, 0};
+    double start = now_ms();
+
+    for (unsigned int i = 0; i < rounds; i++) {
+        pool_run(pool, &job);
+    }
+    printf("%-24s %u threads: %8.3f us/job\n", "pool dispatch",
+           pool_size(pool), (now_ms() - start) * 1000.0 / rounds);
+}
+
+int main(int argc, char* argv[])
+{
+    struct image_format fmt;
+    unsigned int frames = BENCH_FRAMES;
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.width  = BENCH_WIDTH;
+    fmt.height = BENCH_HEIGHT;
+    if (argc > 2) {
+        fmt.width  = atoi(argv[1]);
+        fmt.height = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        frames = atoi(argv[3]);
+    }
+    if (!fmt.width || !fmt.height || !frames) {
+        fprintf(stderr, "Usage: %s [width height [frames]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    prepare_duration_hashmaps(8192);
+    struct bench_args args = {
+        .levels  = prepare_levels_state(),
+        .balance = WB_NONE,
+        .pool    = pool_create(NULL)
+    };
+    run_dispatch(args.pool, BENCH_ROUNDS);
+
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        if (!pass) {
+            fmt.pixelformat  = PIXEL_YV12;
+            fmt.bytesperline = fmt.width;
+        } else {
+            fmt.pixelformat  = PIXEL_RGB;
+            fmt.bytesperline = fmt.width * 3;
+            fmt.colorspace   = COLOR_RGB;
+        }
+        fmt.size = fmt.height * fmt.bytesperline;
+
+        args.balance = WB_NONE;
+        run_bench("equalize", bench_equalize, &args, &fmt, frames);
+        run_bench("auto-levels", bench_autolevels, &args, &fmt, frames);
+        run_frames("equalize frames", bench_equalize, &args, &fmt, frames);
+        run_defisheye(&args, &fmt, frames);
+        run_mesh(&args, &fmt, frames);
+        run_scale(&args, &fmt, frames);
+        run_panorama(&args, &fmt, frames);
+        run_views(&args, &fmt, frames);
+        if (fmt.pixelformat == PIXEL_RGB) {
+            args.balance = WB_GRAY_WORLD;
+            run_bench("equalize gray-world", bench_equalize, &args, &fmt,
+                      frames);
+            run_bench("auto-levels gray-world", bench_autolevels, &args, &fmt,
+                      frames);
+        }
+    }
+
+    release_levels_state(args.levels);
+    pool_destroy(args.pool);
+    release_duration_hashmaps();
+
+    return EXIT_SUCCESS;
+}
@@ -25,7 +25,6 @@
 
 #include "gvision_multithread.h"
 #include "gvision_common.h"
-#include "histogram/gvision_histogram.h"
 #include "duration/gvision_duration.h"
 #include "hashmap/gvision_hash.h"
 
@@ -39,107 +38,646 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <assert.h>
-#include <semaphore.h>
 #include <sys/types.h>
 #include <sys/time.h>
 
-tcontext_t*     ctx;
-pthread_t*      threads;
-pthread_attr_t* pthread_attr;
+/**
+ * Chunks owned by one thread: the owner takes them from the head in order,
+ * other threads steal them from the tail. Head and tail share one word so
+ * both ends are updated with a single compare-and-swap.
+ */
+struct steal_deque {
+    uint64_t range;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define DEQUE_RANGE(head, tail) (((uint64_t)(tail) << 32) | (head))
+#define DEQUE_HEAD(range)       ((uint32_t)(range))
+#define DEQUE_TAIL(range)       ((uint32_t)((range) >> 32))
+
+/**
+ * Submitted job with its progress. Lives on the stack of the submitter
+ * until no worker is attached to it any more.
+ */
+struct pool_task {
+    struct pool_job job;
+    /**
+     * One deque per thread working on the task, the submitter owns the
+     * last one, joining workers take the others in order
+     */
+    struct steal_deque* deques;
+    unsigned int slots;
+    /* Workers which joined so far, protected by the pool lock */
+    unsigned int joined;
+    /* Items not completed yet */
+    uint32_t remaining;
+    /* Workers currently working on the task */
+    unsigned int attached;
+    /* Priority of the submitting stream */
+    int priority;
+    /* Queued, workers can still attach, protected by the pool lock */
+    bool linked;
+    struct pool_task* link;
+};
+
+struct pool_core {
+    tcontext_t* ctx;
+    /* Worker threads, the submitting thread is not counted */
+    unsigned int threads;
+    pthread_attr_t* pthread_attr;
+
+    pthread_mutex_t lock;
+    /* Signaled when tasks are queued or the pool stops */
+    pthread_cond_t wake;
+    /* Signaled when the last worker detaches from a task */
+    pthread_cond_t done;
+
+    /* Tasks with unclaimed chunks */
+    struct pool_task* head;
+    struct pool_task* tail;
+    /* Number of queued tasks, polled without the lock while spinning */
+    unsigned int queued;
+    /* Spin budget of submitters waiting for completion */
+    unsigned int spin;
+    bool running;
+
+    /* CPUs the workers are pinned to, cpu_count is zero without pinning */
+    int* cpu_list;
+    unsigned int cpu_count;
+    enum sched_policy policy;
+    int priority;
+
+    /* Pool handles using the threads, protected by shared_lock */
+    unsigned int users;
+};
+
+/**
+ * Setup of one stage: threads and, for rows, chunks per thread as
+ * 1 << (2 * split), for tiles the tile edge POOL_TILE_MIN << split
+ */
+struct tune_choice {
+    uint32_t workers;
+    uint32_t split;
+};
+
+/**
+ * Online tuning state of one stage, a band function at one call site on
+ * one frame size
+ */
+struct stage_tuner {
+    band_func_t func;
+    unsigned int id;
+    uint32_t width;
+    uint32_t height;
+    uint64_t last_use;
+
+    struct tune_choice choice[POOL_TUNE_CHOICES];
+    /* Mean time of each choice in the last exploration, ms */
+    double cost[POOL_TUNE_CHOICES];
+    unsigned int choices;
+
+    /* Choice being measured while exploring, the best one otherwise */
+    unsigned int current;
+    unsigned int samples;
+    bool exploring;
+    /* Only the choices next to the best one are explored */
+    bool local;
+    unsigned int best;
+    /* Moving average of the best choice, ms */
+    double average;
+};
+
+/* Handle of one stream, several of them can share the threads */
+struct worker_pool {
+    struct pool_core* core;
+    int priority;
+
+    /* Pick threads and band sizes of the stages from measured times */
+    bool tune;
+    struct stage_tuner stages[POOL_TUNE_STAGES];
+    uint64_t calls;
+};
+
+/* Process-wide pool, set up by the first user and gone with the last */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_core* shared_core = NULL;
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Worker counters, read concurrently by pool_stats() */
+#ifdef CALC_THREAD_DURATION
+#define STATS_NOW() now_ns()
+#define STATS_ADD(tctx, field, value) \
+    __atomic_add_fetch(&(tctx)->stats.field, (value), __ATOMIC_RELAXED)
+#else
+#define STATS_NOW() 0
+#define STATS_ADD(tctx, field, value) ((void)(value))
+#endif
+
+/* Grow the spin budget when spinning paid off, shrink it otherwise */
+static unsigned int adapt_spin(unsigned int spin, bool blocked)
+{
+    if (blocked) {
+        return max(spin >> 1, POOL_SPIN_MIN);
+    }
+    return min(spin << 1, POOL_SPIN_MAX);
+}
+
+/* Pool lock held */
+static void pool_enqueue(struct pool_core* const core,
+                         struct pool_task* const task)
+{
+    task->link = NULL;
+    task->linked = true;
+    if (core->tail) {
+        core->tail->link = task;
+    } else {
+        core->head = task;
+    }
+    core->tail = task;
+    __atomic_store_n(&core->queued, core->queued + 1, __ATOMIC_RELEASE);
+}
+
+/* Pool lock held */
+static void pool_unlink(struct pool_core* const core,
+                        struct pool_task* const task)
+{
+    struct pool_task* prev = NULL;
+
+    if (!task->linked) {
+        return;
+    }
+    for (struct pool_task* it = core->head; it; prev = it, it = it->link) {
+        if (it != task) {
+            continue;
+        }
+        if (prev) {
+            prev->link = it->link;
+        } else {
+            core->head = it->link;
+        }
+        if (core->tail == it) {
+            core->tail = prev;
+        }
+        __atomic_store_n(&core->queued, core->queued - 1, __ATOMIC_RELEASE);
+        break;
+    }
+    task->linked = false;
+}
+
+/* Take the first chunk of the own deque */
+static bool deque_pop(struct steal_deque* const deque, uint32_t* chunk)
+{
+    uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+
+    while (DEQUE_HEAD(range) < DEQUE_TAIL(range)) {
+        uint64_t next = DEQUE_RANGE(DEQUE_HEAD(range) + 1, DEQUE_TAIL(range));
+        if (__atomic_compare_exchange_n(&deque->range, &range, next, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = DEQUE_HEAD(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Take the last chunk of another deque */
+static bool deque_steal(struct steal_deque* const deque, uint32_t* chunk)
+{
+    uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+
+    while (DEQUE_HEAD(range) < DEQUE_TAIL(range)) {
+        uint64_t next = DEQUE_RANGE(DEQUE_HEAD(range), DEQUE_TAIL(range) - 1);
+        if (__atomic_compare_exchange_n(&deque->range, &range, next, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = DEQUE_TAIL(range) - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Run chunks of the own deque in order, then steal from the others,
+ * starting with the neighbour. Returns once every deque is empty, with
+ * the number of chunks run, stolen ones counted in steals as well.
+ */
+static uint32_t task_work(struct pool_core* const core,
+                          struct pool_task* const task, unsigned int worker,
+                          unsigned int own, uint32_t* const steals)
+{
+    const struct pool_job* job = &task->job;
+    uint32_t chunk;
+    uint32_t chunks = 0;
+
+    for (;;) {
+        bool found = deque_pop(&task->deques[own], &chunk);
+
+        for (unsigned int i = 1; !found && i < task->slots; i++) {
+            found = deque_steal(&task->deques[(own + i) % task->slots],
+                                &chunk);
+            *steals += found;
+        }
+        if (!found) {
+            break;
+        }
+        chunks++;
+
+        uint32_t begin = job->begin + chunk * job->grain;
+        uint32_t end = job->end - begin > job->grain ?
+                       begin + job->grain : job->end;
+
+        job->func(job->arg, begin, end, worker);
+        __atomic_sub_fetch(&task->remaining, end - begin, __ATOMIC_ACQ_REL);
+    }
+
+    /* Drained, nobody needs to attach any more */
+    pthread_mutex_lock(&core->lock);
+    pool_unlink(core, task);
+    pthread_mutex_unlock(&core->lock);
+
+    return chunks;
+}
+
+static void task_detach(struct pool_core* const core,
+                        struct pool_task* const task)
+{
+    /* The task may be gone as soon as the last worker detaches */
+    if (!__atomic_sub_fetch(&task->attached, 1, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_lock(&core->lock);
+        pthread_cond_broadcast(&core->done);
+        pthread_mutex_unlock(&core->lock);
+    }
+}
+
+static void task_wait(struct pool_core* const core,
+                      struct pool_task* const task)
+{
+    unsigned int budget = __atomic_load_n(&core->spin, __ATOMIC_RELAXED);
+    bool blocked = false;
+    uint64_t mark = STATS_NOW();
+
+    for (unsigned int spin = 0; spin < budget; spin++) {
+        if (!__atomic_load_n(&task->attached, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        cpu_relax();
+    }
+
+    if (__atomic_load_n(&task->attached, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&core->lock);
+        while (__atomic_load_n(&task->attached, __ATOMIC_ACQUIRE)) {
+            blocked = true;
+            pthread_cond_wait(&core->done, &core->lock);
+        }
+        pthread_mutex_unlock(&core->lock);
+    }
+    assert(!__atomic_load_n(&task->remaining, __ATOMIC_ACQUIRE));
+
+    /* Submitting threads share the last context */
+    STATS_ADD(&core->ctx[core->threads], wait, STATS_NOW() - mark);
+    STATS_ADD(&core->ctx[core->threads], tasks, 1);
 
-unsigned int cpus = 1;
-bool do_processing = true;
+    __atomic_store_n(&core->spin, adapt_spin(budget, blocked),
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * Task for an idle worker, core lock held: the highest priority first,
+ * among equals the one with the fewest workers so that concurrent
+ * streams get an even share of the threads
+ */
+static struct pool_task* pool_pick(const struct pool_core* const core)
+{
+    struct pool_task* best = NULL;
+    unsigned int load = 0;
+
+    for (struct pool_task* it = core->head; it; it = it->link) {
+        if (it->joined + 1 >= it->slots) {
+            /* Has all the threads it asked for */
+            continue;
+        }
+        unsigned int attached = __atomic_load_n(&it->attached,
+                                                __ATOMIC_RELAXED);
+        if (!best || it->priority > best->priority ||
+            (it->priority == best->priority && attached < load)) {
+            best = it;
+            load = attached;
+        }
+    }
+    return best;
+}
 
-pthread_cond_t  wait_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Runs on the worker itself, nice values are per thread on Linux */
+static void worker_priority(const struct pool_core* const core)
+{
+    if (core->policy == POLICY_FIFO) {
+        struct sched_param param;
+        param.sched_priority = clamp(core->priority,
+                                     sched_get_priority_min(SCHED_FIFO),
+                                     sched_get_priority_max(SCHED_FIFO));
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err) {
+            fprintf(stderr, "Cannot set SCHED_FIFO priority %d: %s\n",
+                    param.sched_priority, strerror(err));
+        }
+    } else if (core->priority) {
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+                        clamp(core->priority, -20, 19))) {
+            perror("Cannot set worker nice value");
+        }
+    }
+}
 
-static void* histogram_calculating_thread(void *arg)
+static void* pool_worker(void *arg)
 {
     tcontext_t *tctx = (tcontext_t *) arg;
+    struct pool_core* core = tctx->core;
+
+    worker_priority(core);
+
+    for (;;) {
+        struct pool_task* task;
+        unsigned int own;
+        uint32_t chunks, steals = 0;
+        bool blocked = false;
+        uint64_t mark = STATS_NOW(), now;
+
+        /* Short spin before sleeping, frames come in bursts of jobs */
+        for (unsigned int spin = 0; spin < tctx->spin; spin++) {
+            if (__atomic_load_n(&core->queued, __ATOMIC_ACQUIRE) ||
+                !__atomic_load_n(&core->running, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            cpu_relax();
+        }
+
+        now = STATS_NOW();
+        STATS_ADD(tctx, wait, now - mark);
+        mark = now;
 
-    while(do_processing) {
+        pthread_mutex_lock(&core->lock);
+        while (!(task = pool_pick(core)) && core->running) {
+            __atomic_store_n(&tctx->state, STANDBY, __ATOMIC_RELAXED);
+            blocked = true;
+            pthread_cond_wait(&core->wake, &core->lock);
+        }
+        if (!task) {
+            /* Stopped and nothing left to do */
+            pthread_mutex_unlock(&core->lock);
+            break;
+        }
+        own = task->joined++;
+        __atomic_add_fetch(&task->attached, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&tctx->state, WORKING, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&core->lock);
 
-        pthread_mutex_lock(&wait_lock);
-        pthread_cond_wait(&wait_cond, &wait_lock);
-        pthread_mutex_unlock(&wait_lock);
+        now = STATS_NOW();
+        STATS_ADD(tctx, idle, now - mark);
+        mark = now;
 
-        /* start time */
-        TimeNode_t point;
-        point.symbolic = HOOK_ID;
-        init_reference_point(point.symbolic, &point);
+        tctx->spin = adapt_spin(tctx->spin, blocked);
 
 #ifdef MTHREAD_DEBUG
-        printf("%s(%d)ID:%d Offs:%p W:%d H:%d BPL:%d HPtr:%p CPU:%d\n",
-               __func__, __LINE__, tctx->id, tctx->offset, tctx->format.width,
-               tctx->format.height, tctx->format.bytesperline, tctx->results,
-               sched_getcpu());
+        printf("%s(%d)ID:%d Task:%p CPU:%d\n", __func__, __LINE__,
+               tctx->id, (void*)task, sched_getcpu());
 #endif
 
-        calc_histogram_pdf(tctx->offset, &tctx->format, tctx->results);
+        chunks = task_work(core, task, tctx->id, own, &steals);
+
+        STATS_ADD(tctx, busy, STATS_NOW() - mark);
+        STATS_ADD(tctx, tasks, 1);
+        STATS_ADD(tctx, chunks, chunks);
+        STATS_ADD(tctx, steals, steals);
 
 #ifdef RANDOM_LAG
         /* Functionality check */
         long int rnd = random() % 140000;
         usleep(rnd);
 #endif
-        tctx->state = STANDBY;
+        task_detach(core, task);
+    }
+    __atomic_store_n(&tctx->state, STANDBY, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+void pool_default_config(struct pool_config* const config)
+{assert(config);
+
+    config->threads   = 0;
+    config->cpus      = NULL;
+    config->numa_node = -1;
+    config->policy    = POLICY_OTHER;
+    config->priority  = 0;
+    config->shared    = false;
+    config->stream_priority = 0;
+    config->tune      = true;
+}
 
-        /* stop time */
-        init_reference_point(point.symbolic, &point);
+/* Parse a list like "0-3,8,10-11" */
+static bool parse_cpu_list(const char* list, cpu_set_t* const cpuset)
+{
+    CPU_ZERO(cpuset);
+    while (*list) {
+        char* end;
+        unsigned long first, last;
+
+        while (*list == ' ' || *list == ',' || *list == '\n') {
+            list++;
+        }
+        if (!*list) {
+            break;
+        }
+        first = strtoul(list, &end, 10);
+        if (end == list) {
+            return false;
+        }
+        last = first;
+        list = end;
+        if (*list == '-') {
+            last = strtoul(++list, &end, 10);
+            if (end == list || last < first) {
+                return false;
+            }
+            list = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, cpuset);
+        }
     }
-	return NULL;
+    return CPU_COUNT(cpuset) > 0;
 }
 
-void prepare_histogram_pdf_mt()
+static bool read_node_cpus(int node, cpu_set_t* const cpuset)
 {
-    unsigned int piece;
-    cpus = sysconf(_SC_NPROCESSORS_CONF);
+    char path[64];
+    char* line = NULL;
+    size_t length = 0;
+    bool valid = false;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    if (getline(&line, &length, file) > 0) {
+        valid = parse_cpu_list(line, cpuset);
+    }
+    free(line);
+    fclose(file);
 
+    return valid;
+}
+
+/* CPUs the workers are pinned to, in order, zero when not pinned */
+static unsigned int pool_cpus(struct pool_core* const core,
+                              const struct pool_config* const config)
+{
     cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
+    unsigned int count = 0;
 
-    threads = (pthread_t *) malloc(cpus * sizeof(*threads));
-    pthread_attr = (pthread_attr_t *) malloc(cpus * sizeof(*pthread_attr));
-    ctx = (tcontext_t*) calloc(cpus, sizeof(tcontext_t));
+    if (config->cpus && *config->cpus) {
+        if (!parse_cpu_list(config->cpus, &cpuset)) {
+            fprintf(stderr, "Invalid CPU list '%s'\n", config->cpus);
+            return 0;
+        }
+    } else if (config->numa_node >= 0) {
+        if (!read_node_cpus(config->numa_node, &cpuset)) {
+            fprintf(stderr, "Cannot read CPUs of NUMA node %d\n",
+                    config->numa_node);
+            return 0;
+        }
+    } else {
+        return 0;
+    }
 
-    do_processing = true;
+    core->cpu_list = calloc(CPU_COUNT(&cpuset), sizeof(*core->cpu_list));
+    if (!core->cpu_list) {
+        fprintf(stderr, "Cannot allocate CPU list\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpuset)) {
+            core->cpu_list[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+static struct pool_core* core_create(const struct pool_config* const config)
+{
+    unsigned int piece;
+    unsigned int threads;
+    struct pool_core* core = calloc(1, sizeof(*core));
+    if (!core) {
+        fprintf(stderr, "Cannot allocate worker pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    core->cpu_count = pool_cpus(core, config);
+    core->policy    = config->policy;
+    core->priority  = config->priority;
+    core->users     = 1;
+
+    threads = config->threads;
+    if (!threads) {
+        threads = core->cpu_count ? core->cpu_count :
+                  (unsigned int)max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    }
+    /* The submitting thread is one of them */
+    core->threads = threads > 1 ? threads - 1 : 0;
+    core->spin    = POOL_SPIN_MIN;
+    core->running = true;
+
+    pthread_mutex_init(&core->lock, NULL);
+    pthread_cond_init(&core->wake, NULL);
+    pthread_cond_init(&core->done, NULL);
+
+    core->pthread_attr = calloc(core->threads + 1, sizeof(pthread_attr_t));
+    if (posix_memalign((void**)&core->ctx, CACHE_LINE_SIZE,
+                       (core->threads + 1) * sizeof(tcontext_t))) {
+        core->ctx = NULL;
+    }
+    if (!core->pthread_attr || !core->ctx) {
+        fprintf(stderr, "Cannot allocate worker contexts\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(core->ctx, 0, (core->threads + 1) * sizeof(tcontext_t));
 
     /* Create and setup each thread. */
-    for (piece = 0; piece < cpus; piece++) {
+    for (piece = 0; piece < core->threads; piece++) {
+        tcontext_t* tctx = &core->ctx[piece];
+        tctx->id    = piece;
+        tctx->core  = core;
+        tctx->spin  = POOL_SPIN_MIN;
+        tctx->state = STANDBY;
+
         /* Initialize thread creation attributes */
-        CPU_SET(piece, &cpuset);
-        if (pthread_attr_init(&pthread_attr[piece])) {
+        if (pthread_attr_init(&core->pthread_attr[piece])) {
             perror("Cannon init pthread attributes.");
         }
-        pthread_attr_setaffinity_np(&pthread_attr[piece], sizeof(cpuset),
-                                    &cpuset);
-        pthread_create(&threads[piece], &pthread_attr[piece],
-                       histogram_calculating_thread, &ctx[piece]);
+        if (core->cpu_count) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(core->cpu_list[piece % core->cpu_count], &cpuset);
+            pthread_attr_setaffinity_np(&core->pthread_attr[piece],
+                                        sizeof(cpuset), &cpuset);
+        }
+        if (pthread_create(&tctx->thread, &core->pthread_attr[piece],
+                           pool_worker, tctx)) {
+            perror("Cannon create pthread.");
+            exit(EXIT_FAILURE);
+        }
     }
     srandom(time(NULL));
+
+    return core;
 }
 
-void release_histogram_pdf_mt()
+static void core_destroy(struct pool_core* core)
 {
     unsigned int piece;
 
-    do_processing = false;
-    pthread_cond_broadcast(&wait_cond);
+    pthread_mutex_lock(&core->lock);
+    __atomic_store_n(&core->running, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&core->wake);
+    pthread_mutex_unlock(&core->lock);
 
     /* Synchronize the completion of each thread. */
-    for (piece = 0; piece < cpus; piece++) {
+    for (piece = 0; piece < core->threads; piece++) {
         void *result;
-        if (pthread_join(threads[piece], &result)) {
+        if (pthread_join(core->ctx[piece].thread, &result)) {
             perror("Cannon join pthread.");
         }
         if (result) {
             printf("pthread %d joined with returned value is %s\n",
-                   ctx[piece].id, (char*) result);
+                   core->ctx[piece].id, (char*) result);
         }
 
         /* Destroy the thread attributes object */
-        if (pthread_attr_destroy(&pthread_attr[piece])) {
+        if (pthread_attr_destroy(&core->pthread_attr[piece])) {
             perror("Cannon destroy pthread attributes.");
         }
 
@@ -147,60 +685,509 @@ void release_histogram_pdf_mt()
         free(result);
     }
 
-    free(threads);
-    free(pthread_attr);
-    free(ctx);
+    pthread_cond_destroy(&core->done);
+    pthread_cond_destroy(&core->wake);
+    pthread_mutex_destroy(&core->lock);
+
+    free(core->cpu_list);
+    free(core->pthread_attr);
+    free(core->ctx);
+    free(core);
+}
+
+struct worker_pool* pool_create(const struct pool_config* config)
+{
+    struct pool_config defaults;
+    struct worker_pool* pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        fprintf(stderr, "Cannot allocate worker pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!config) {
+        pool_default_config(&defaults);
+        config = &defaults;
+    }
+    pool->priority = config->stream_priority;
+    pool->tune     = config->tune;
+
+    if (!config->shared) {
+        pool->core = core_create(config);
+        return pool;
+    }
+
+    /* The first user sets the process-wide pool up */
+    pthread_mutex_lock(&shared_lock);
+    if (shared_core) {
+        shared_core->users++;
+    } else {
+        shared_core = core_create(config);
+    }
+    pool->core = shared_core;
+    pthread_mutex_unlock(&shared_lock);
+
+    return pool;
 }
 
-void calc_histogram_pdf_mt(const uint8_t* const buf,
-                           const struct image_format* const fmt,
-                           uint16_t* const hresult)
-{assert(buf && fmt && hresult);
+unsigned int pool_size(const struct worker_pool* const pool)
+{assert(pool);
 
-#ifdef CALC_TOTAL_DURATION
-    /* start time */
-    TimeNode_t point;
-    point.symbolic = HOOK_ID;
-    init_reference_point(point.symbolic, &point);
-#endif
-    unsigned int piece;
-    uint32_t piece_height = fmt->height / cpus;
-    uint32_t piece_size   = fmt->size   / cpus;
-    uint32_t lines_rest   = fmt->height % cpus;
-
-	/* Start up thread */
-    for (piece = 0; piece < cpus; piece++) {
-		ctx[piece].id = piece;
-		ctx[piece].results = hresult;
-        ctx[piece].state = WORKING;
-
-        /* Propagate buffer offset */
-        ctx[piece].offset = &buf[piece_height * piece * fmt->bytesperline];
-
-        /* Propagate parameters */
-        ctx[piece].format = *fmt;
-        /* Overwrite hight and size */
-        ctx[piece].format.height = piece_height;
-        ctx[piece].format.size   = piece_size;
-
-        /* In case of odd thread count, add rest of lines to first thread */
-        if (lines_rest && !piece) {
-            /* Adding rest of lines */
-            ctx[piece].format.height += fmt->height % cpus;
-            /* Recalculate the size */
-            ctx[piece].format.size = piece_height * fmt->bytesperline;
-        }
-	}
-
-    pthread_cond_broadcast(&wait_cond);
-    for (piece = 0; piece < cpus; piece++) {
-        while(ctx[piece].state != STANDBY) {
-            sched_yield();
-        };
-    }
-#ifdef CALC_TOTAL_DURATION
-    /* stop time */
-    init_reference_point(point.symbolic, &point);
+    return pool->core->threads + 1;
+}
+
+unsigned int pool_stats(const struct worker_pool* const pool,
+                        struct worker_stats* const stats, unsigned int count)
+{assert(pool && (stats || !count));
+
+    const struct pool_core* core = pool->core;
+
+    if (count) {
+        memset(stats, 0, count * sizeof(*stats));
+    }
+#ifdef CALC_THREAD_DURATION
+    for (unsigned int i = 0; i < min(count, core->threads + 1); i++) {
+        const struct worker_stats* from = &core->ctx[i].stats;
+        stats[i].busy   = __atomic_load_n(&from->busy,   __ATOMIC_RELAXED);
+        stats[i].idle   = __atomic_load_n(&from->idle,   __ATOMIC_RELAXED);
+        stats[i].wait   = __atomic_load_n(&from->wait,   __ATOMIC_RELAXED);
+        stats[i].tasks  = __atomic_load_n(&from->tasks,  __ATOMIC_RELAXED);
+        stats[i].chunks = __atomic_load_n(&from->chunks, __ATOMIC_RELAXED);
+        stats[i].steals = __atomic_load_n(&from->steals, __ATOMIC_RELAXED);
+    }
 #endif
+    return core->threads + 1;
+}
+
+void pool_destroy(struct worker_pool* pool)
+{
+    struct pool_core* core;
+
+    if (!pool) {
+        return;
+    }
+    core = pool->core;
+    free(pool);
+
+    pthread_mutex_lock(&shared_lock);
+    if (--core->users) {
+        core = NULL;
+    } else if (core == shared_core) {
+        shared_core = NULL;
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    if (core) {
+        core_destroy(core);
+    }
+}
+
+/* Nobody to share with */
+static void run_serial(const struct pool_job* const job, uint32_t grain)
+{
+    uint32_t begin, end;
+
+    for (begin = job->begin; begin < job->end; begin = end) {
+        end = job->end - begin > grain ? begin + grain : job->end;
+        job->func(job->arg, begin, end, 0);
+    }
+}
+
+/* Hand the chunks of an initialized task out and queue it */
+static void task_start(struct worker_pool* const pool,
+                       struct pool_task* const task,
+                       struct steal_deque* const deques)
+{
+    struct pool_core* core = pool->core;
+    const struct pool_job* job = &task->job;
+
+    /**
+     * Every thread starts with a contiguous run of chunks, neighbouring
+     * chunks touch neighbouring memory
+     */
+    uint32_t chunks = (job->end - job->begin + job->grain - 1) / job->grain;
+
+    task->deques    = deques;
+    task->slots     = core->threads + 1;
+    if (job->workers) {
+        task->slots = min(job->workers, task->slots);
+    }
+    task->joined    = 0;
+    task->remaining = job->end - job->begin;
+    task->attached  = 0;
+    task->priority  = pool->priority;
+    for (unsigned int slot = 0; slot < task->slots; slot++) {
+        deques[slot].range = DEQUE_RANGE(
+            (uint64_t)chunks * slot / task->slots,
+            (uint64_t)chunks * (slot + 1) / task->slots);
+    }
+
+    pthread_mutex_lock(&core->lock);
+    pool_enqueue(core, task);
+    pthread_cond_broadcast(&core->wake);
+    pthread_mutex_unlock(&core->lock);
+}
+
+void pool_run(struct worker_pool* const pool, const struct pool_job* const job)
+{assert(pool && job && job->func);
+
+    struct pool_core* core = pool->core;
+    struct pool_task task;
+
+    if (job->end <= job->begin) {
+        return;
+    }
+
+    task.job = *job;
+    task.job.grain = max(job->grain, 1U);
+
+    if (!core->threads || job->workers == 1) {
+        run_serial(&task.job, task.job.grain);
+        return;
+    }
+
+    struct steal_deque deques[core->threads + 1];
+    task_start(pool, &task, deques);
+
+    /* Take part in the own job instead of waiting idle */
+    uint32_t steals = 0;
+    task_work(core, &task, core->threads, task.slots - 1, &steals);
+    task_wait(core, &task);
+}
+
+struct pool_task* pool_submit(struct worker_pool* const pool,
+                              const struct pool_job* const job)
+{assert(pool && job && job->func);
+
+    struct pool_core* core = pool->core;
+    struct pool_task* task = calloc(1, sizeof(*task));
+    if (!task) {
+        fprintf(stderr, "Cannot allocate pool task\n");
+        exit(EXIT_FAILURE);
+    }
+
+    task->job = *job;
+    task->job.grain = max(job->grain, 1U);
+
+    if (!core->threads || job->workers == 1 || job->end <= job->begin) {
+        /* Done by the time it is submitted */
+        run_serial(&task->job, task->job.grain);
+        return task;
+    }
+
+    struct steal_deque* deques;
+    if (posix_memalign((void**)&deques, CACHE_LINE_SIZE,
+                       (core->threads + 1) * sizeof(*deques))) {
+        fprintf(stderr, "Cannot allocate task deques\n");
+        exit(EXIT_FAILURE);
+    }
+    task_start(pool, task, deques);
+
+    return task;
+}
+
+bool pool_ready(const struct pool_task* const task)
+{assert(task);
+
+    return !__atomic_load_n(&task->remaining, __ATOMIC_ACQUIRE) &&
+           !__atomic_load_n(&task->attached, __ATOMIC_ACQUIRE);
+}
+
+void pool_wait(struct worker_pool* const pool, struct pool_task* task)
+{assert(pool && task);
+
+    struct pool_core* core = pool->core;
+
+    if (task->deques) {
+        /* Help with the chunks nobody took yet */
+        uint32_t steals = 0;
+        task_work(core, task, core->threads, task->slots - 1, &steals);
+        task_wait(core, task);
+        free(task->deques);
+    }
+    free(task);
+}
+
+/**
+ * State shared by the chunks of a band job
+ */
+struct band_run {
+    const struct band_job* job;
+    const struct image_format* fmt;
+    uint8_t* scratch;
+    size_t stride;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t tiles_x;
+};
+
+static void* band_scratch(const struct band_run* const run,
+                          unsigned int worker)
+{
+    return run->scratch ? run->scratch + worker * run->stride : NULL;
+}
+
+static void rows_chunk(void* arg, uint32_t begin, uint32_t end,
+                       unsigned int worker)
+{
+    struct band_run* run = arg;
+    struct image_band band = {0, begin, run->fmt->width, end - begin};
+
+    run->job->func(run->job->arg, &band, band_scratch(run, worker));
 }
 
+static void tiles_chunk(void* arg, uint32_t begin, uint32_t end,
+                        unsigned int worker)
+{
+    struct band_run* run = arg;
+    void* scratch = band_scratch(run, worker);
+
+    for (uint32_t tile = begin; tile < end; tile++) {
+        struct image_band band;
+        band.x = (tile % run->tiles_x) * run->tile_width;
+        band.y = (tile / run->tiles_x) * run->tile_height;
+        band.width  = min(run->tile_width,  run->fmt->width  - band.x);
+        band.height = min(run->tile_height, run->fmt->height - band.y);
+
+        run->job->func(run->job->arg, &band, scratch);
+    }
+}
+
+static double now_ms(void)
+{
+    return now_ns() / 1000000.0;
+}
+
+/* Candidates are powers of two threads up to the pool size, every split */
+static void tune_setup(struct stage_tuner* const stage,
+                       const struct worker_pool* const pool,
+                       const struct band_job* const job,
+                       const struct image_format* const fmt)
+{
+    unsigned int size = pool_size(pool);
+
+    memset(stage, 0, sizeof(*stage));
+    stage->func   = job->func;
+    stage->id     = job->stage;
+    stage->width  = fmt->width;
+    stage->height = fmt->height;
+    for (uint32_t workers = 1; ; workers = min(workers * 2, size)) {
+        for (uint32_t split = 0; split < POOL_TUNE_SPLITS &&
+                                 stage->choices < POOL_TUNE_CHOICES; split++) {
+            stage->choice[stage->choices].workers = workers;
+            stage->choice[stage->choices].split   = split;
+            stage->choices++;
+        }
+        if (workers == size) {
+            break;
+        }
+    }
+    stage->exploring = true;
+}
+
+/* Same band function at the same call site on the same frame size */
+static bool tune_match(const struct stage_tuner* const stage,
+                       const struct band_job* const job,
+                       const struct image_format* const fmt)
+{
+    return stage->func == job->func && stage->id == job->stage &&
+           stage->width == fmt->width && stage->height == fmt->height;
+}
+
+/* Tuning state of the stage, the least recently used one is recycled */
+static struct stage_tuner* tune_stage(struct worker_pool* const pool,
+                                      const struct band_job* const job,
+                                      const struct image_format* const fmt)
+{
+    struct stage_tuner* stage = &pool->stages[0];
+
+    for (unsigned int i = 0; i < POOL_TUNE_STAGES; i++) {
+        struct stage_tuner* it = &pool->stages[i];
+        if (tune_match(it, job, fmt)) {
+            stage = it;
+            break;
+        }
+        if (it->last_use < stage->last_use) {
+            stage = it;
+        }
+    }
+    if (!tune_match(stage, job, fmt)) {
+        tune_setup(stage, pool, job, fmt);
+    }
+    stage->last_use = ++pool->calls;
+
+    return stage;
+}
+
+/* Choices are laid out by thread count, then by split */
+static bool tune_explored(const struct stage_tuner* const stage,
+                          unsigned int choice)
+{
+    unsigned int workers = choice / POOL_TUNE_SPLITS;
+    unsigned int split   = choice % POOL_TUNE_SPLITS;
+    unsigned int best_workers = stage->best / POOL_TUNE_SPLITS;
+    unsigned int best_split   = stage->best % POOL_TUNE_SPLITS;
+
+    return !stage->local ||
+           (workers + 1 >= best_workers && best_workers + 1 >= workers &&
+            split + 1 >= best_split && best_split + 1 >= split);
+}
+
+/* First choice to measure from the given one on */
+static unsigned int tune_next(const struct stage_tuner* const stage,
+                              unsigned int choice)
+{
+    while (choice < stage->choices && !tune_explored(stage, choice)) {
+        choice++;
+    }
+    return choice;
+}
+
+/* Measure every choice again, or the ones next to the best one */
+static void tune_explore(struct stage_tuner* const stage, bool local)
+{
+    stage->local = local;
+    stage->best  = stage->current;
+    for (unsigned int i = 0; i < stage->choices; i++) {
+        if (tune_explored(stage, i)) {
+            stage->cost[i] = 0.0;
+        }
+    }
+    stage->current   = tune_next(stage, 0);
+    stage->samples   = 0;
+    stage->exploring = true;
+}
+
+/* Account the time of the current choice and pick the next one */
+static void tune_update(struct stage_tuner* const stage, double elapsed)
+{
+    if (stage->exploring) {
+        stage->cost[stage->current] += elapsed / POOL_TUNE_SAMPLES;
+        if (++stage->samples < POOL_TUNE_SAMPLES) {
+            return;
+        }
+        stage->samples = 0;
+        stage->current = tune_next(stage, stage->current + 1);
+        if (stage->current < stage->choices) {
+            return;
+        }
+
+        /* Settle on the fastest one of the measured ones */
+        stage->current = tune_next(stage, 0);
+        for (unsigned int i = stage->current + 1; i < stage->choices; i++) {
+            if (tune_explored(stage, i) &&
+                stage->cost[i] < stage->cost[stage->current]) {
+                stage->current = i;
+            }
+        }
+        stage->average   = stage->cost[stage->current];
+        stage->exploring = false;
+        return;
+    }
+
+    stage->average += (elapsed - stage->average) * POOL_TUNE_SMOOTHING;
+    /**
+     * Look around the best choice from time to time, and at every choice
+     * at once when the load changed
+     */
+    if (stage->average > stage->cost[stage->current] * POOL_TUNE_SLOWDOWN) {
+        tune_explore(stage, false);
+    } else if (++stage->samples >= POOL_TUNE_PERIOD) {
+        tune_explore(stage, true);
+    }
+}
+
+/* Run the chunks with one scratch area per thread, then reduce them */
+static void band_dispatch(struct worker_pool* const pool,
+                          struct band_run* const run,
+                          const struct pool_job* const pjob)
+{
+    unsigned int workers = pool ? pool_size(pool) : 1;
+
+    run->stride  = (run->job->scratch_size + CACHE_LINE_SIZE - 1) &
+                   ~(size_t)(CACHE_LINE_SIZE - 1);
+    run->scratch = NULL;
+    if (run->stride) {
+        if (posix_memalign((void**)&run->scratch, CACHE_LINE_SIZE,
+                           workers * run->stride)) {
+            fprintf(stderr, "Cannot allocate scratch memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(run->scratch, 0, workers * run->stride);
+    }
+
+    if (pool) {
+        pool_run(pool, pjob);
+    } else {
+        pjob->func(pjob->arg, pjob->begin, pjob->end, 0);
+    }
+
+    if (run->job->reduce) {
+        for (unsigned int worker = 0; worker < workers; worker++) {
+            run->job->reduce(run->job->arg, band_scratch(run, worker));
+        }
+    }
+    free(run->scratch);
+}
+
+void parallel_for_rows(struct worker_pool* const pool,
+                       const struct image_format* const fmt,
+                       const struct band_job* const job, uint32_t rows)
+{assert(fmt && job && job->func);
+
+    struct band_run run = {job, fmt, NULL, 0, 0, 0, 0};
+    struct pool_job pjob = {rows_chunk, &run, 0, fmt->height, rows, 0};
+
+    if (!rows && pool && pool->tune) {
+        struct stage_tuner* stage = tune_stage(pool, job, fmt);
+        const struct tune_choice* choice = &stage->choice[stage->current];
+
+        pjob.workers = choice->workers;
+        pjob.grain   = max(fmt->height /
+                           (choice->workers << (2 * choice->split)), 1U);
+
+        double start = now_ms();
+        band_dispatch(pool, &run, &pjob);
+        tune_update(stage, now_ms() - start);
+        return;
+    }
+
+    if (!rows) {
+        unsigned int workers = pool ? pool_size(pool) : 1;
+        pjob.grain = max(fmt->height / (workers * POOL_CHUNKS_PER_THREAD),
+                         1U);
+    }
+    band_dispatch(pool, &run, &pjob);
+}
+
+void parallel_for_tiles(struct worker_pool* const pool,
+                        const struct image_format* const fmt,
+                        const struct band_job* const job,
+                        uint32_t tile_width, uint32_t tile_height)
+{assert(fmt && job && job->func);
+
+    struct stage_tuner* stage = NULL;
+    uint32_t workers = 0;
+
+    if (!tile_width || !tile_height) {
+        tile_width = tile_height = POOL_TILE_SIZE;
+        if (pool && pool->tune) {
+            stage = tune_stage(pool, job, fmt);
+            workers = stage->choice[stage->current].workers;
+            tile_width = tile_height =
+                POOL_TILE_MIN << stage->choice[stage->current].split;
+        }
+    }
+
+    uint32_t tiles_x = (fmt->width  + tile_width  - 1) / tile_width;
+    uint32_t tiles_y = (fmt->height + tile_height - 1) / tile_height;
+    struct band_run run = {job, fmt, NULL, 0, tile_width, tile_height,
+                           tiles_x};
+    struct pool_job pjob = {tiles_chunk, &run, 0, tiles_x * tiles_y, 1,
+                            workers};
+
+    double start = now_ms();
+    band_dispatch(pool, &run, &pjob);
+    if (stage) {
+        tune_update(stage, now_ms() - start);
+    }
+}
@@ -0,0 +1,790 @@
+/**
+ * Copyright (c) 2017 Atanas Filipov <it.feel.filipov@gmail.com>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <string.h>
+
+#include "gvision_ptz.h"
+#include "gvision_multithread.h"
+
+#include "defisheye/gvision_defisheye.h"
+#include "remap/gvision_remap.h"
+#include "duration/gvision_duration.h"
+
+enum {
+  PROP_PAD_0,
+  PROP_PAD_PAN,
+  PROP_PAD_TILT,
+  PROP_PAD_ZOOM
+};
+
+enum {
+  PROP_0,
+  PROP_INTERPOLATION,
+  PROP_MAP_TYPE,
+  PROP_LENS_MODEL,
+  PROP_FOV,
+  PROP_VIEW,
+  PROP_CACHE_SIZE,
+  PROP_THREADS,
+  PROP_SHARED_POOL
+};
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS (
+        "video/x-raw,format=YV12;"
+        "video/x-raw,format=RGB;")
+   );
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src_%u",
+    GST_PAD_SRC,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS (
+        "video/x-raw,format=YV12;"
+        "video/x-raw,format=RGB;")
+    );
+
+G_DEFINE_TYPE (GstGVisionPtzPad, gst_gvision_ptz_pad, GST_TYPE_PAD);
+
+#define gst_gvision_ptz_parent_class parent_class
+G_DEFINE_TYPE (GstGVisionPtz, gst_gvision_ptz, GST_TYPE_ELEMENT);
+
+/* Pool of output buffers of the current caps of the view */
+static GstBufferPool *gvision_ptz_output_pool(GstGVisionPtzPad *view)
+{
+    if (!view->out_pool) {
+        GstCaps *caps = gst_pad_get_current_caps(GST_PAD(view));
+        GstBufferPool *pool = gst_buffer_pool_new();
+        GstStructure *config = gst_buffer_pool_get_config(pool);
+
+        gst_buffer_pool_config_set_params(config, caps,
+                                          gvision_frame_size(&view->format),
+                                          2, 0);
+        if (caps) {
+            gst_caps_unref(caps);
+        }
+        if (!gst_buffer_pool_set_config(pool, config) ||
+            !gst_buffer_pool_set_active(pool, TRUE)) {
+            GST_ERROR("Cannot set up the output buffer pool");
+            gst_object_unref(pool);
+            return NULL;
+        }
+        view->out_pool = pool;
+    }
+    return view->out_pool;
+}
+
+/* The table and output buffers of the view follow its size */
+static void gvision_ptz_release_view(GstGVisionPtzPad *view)
+{
+    release_remap_table(view->remap);
+    view->remap = NULL;
+    if (view->out_pool) {
+        gst_buffer_pool_set_active(view->out_pool, FALSE);
+        gst_object_unref(view->out_pool);
+        view->out_pool = NULL;
+    }
+}
+
+/* Src pads with a reference each, the list is safe from request and release */
+static GList *gvision_ptz_views(GstGVisionPtz *ptz)
+{
+    GList *views;
+
+    GST_OBJECT_LOCK(ptz);
+    views = g_list_copy_deep(GST_ELEMENT(ptz)->srcpads,
+                             (GCopyFunc) gst_object_ref, NULL);
+    GST_OBJECT_UNLOCK(ptz);
+    return views;
+}
+
+/* Stream start, segment and tags of the input go to every view */
+static gboolean gvision_ptz_copy_sticky(GstPad *pad, GstEvent **event,
+                                        gpointer user_data)
+{
+    GstPad *srcpad = user_data;
+
+    if (GST_EVENT_TYPE(*event) != GST_EVENT_CAPS &&
+        GST_EVENT_TYPE(*event) != GST_EVENT_EOS) {
+        gst_pad_store_sticky_event(srcpad, *event);
+    }
+    return TRUE;
+}
+
+/* Push the caps of the view, in the size its downstream takes */
+static gboolean gvision_ptz_negotiate(GstGVisionPtz *ptz,
+                                      GstGVisionPtzPad *view)
+{
+    GstCaps *caps = gst_pad_get_current_caps(ptz->sinkpad);
+    GstCaps *out;
+
+    if (!caps) {
+        return FALSE;
+    }
+    out = gvision_output_caps(GST_PAD(view), caps);
+    gst_caps_unref(caps);
+    if (!out) {
+        GST_ERROR("No output caps downstream of %s accepts",
+                  GST_PAD_NAME(view));
+        return FALSE;
+    }
+
+    gvision_ptz_release_view(view);
+    gvision_get_video_caps(&view->format, out);
+    gst_pad_sticky_events_foreach(ptz->sinkpad, gvision_ptz_copy_sticky,
+                                  view);
+    view->reconfigure = !gst_pad_push_event(GST_PAD(view),
+                                            gst_event_new_caps(out));
+    gst_caps_unref(out);
+    return !view->reconfigure;
+}
+
+/**
+ * Follow the lens and the direction of the view with its table. Tables in
+ * the cache are taken at once, others are built here on the whole pool.
+ */
+static void gvision_ptz_update_remap(GstGVisionPtz *ptz,
+                                     GstGVisionPtzPad *view)
+{
+    const uint32_t mesh_shift = ptz->map_type == MAP_MESH ?
+                                REMAP_MESH_SHIFT : 0;
+    struct defisheye_params lens;
+    struct remap_table *table;
+    char key[REMAP_KEY_SIZE];
+
+    GST_OBJECT_LOCK(ptz);
+    lens = ptz->lens;
+    GST_OBJECT_UNLOCK(ptz);
+    if (lens.model == LENS_POLYNOMIAL) {
+        /* Only the projection models turn */
+        lens.model = LENS_EQUIDISTANT;
+    }
+    GST_OBJECT_LOCK(view);
+    lens.pan  = view->pan;
+    lens.tilt = view->tilt;
+    lens.zoom = view->zoom;
+    GST_OBJECT_UNLOCK(view);
+
+    if (view->remap && view->remap->mesh_shift == mesh_shift &&
+        !memcmp(&view->remap_lens, &lens, sizeof(lens))) {
+        return;
+    }
+
+    defisheye_table_key(&ptz->format, &view->format, &lens, mesh_shift,
+                        key);
+    table = remap_cache_get(ptz->tables, key);
+    if (!table) {
+        table = prepare_defisheye_table(&ptz->format, &view->format, &lens,
+                                        mesh_shift, ptz->pool);
+        remap_cache_put(ptz->tables, key, table);
+    }
+    release_remap_table(view->remap);
+    view->remap      = table;
+    view->remap_lens = lens;
+}
+
+/* Table and output buffer of the view for the next frame */
+static GstFlowReturn gvision_ptz_prepare_view(GstGVisionPtz *ptz,
+                                              GstGVisionPtzPad *view)
+{
+    GstBufferPool *pool;
+
+    if ((gst_pad_check_reconfigure(GST_PAD(view)) || view->reconfigure) &&
+        !gvision_ptz_negotiate(ptz, view)) {
+        view->reconfigure = TRUE;
+        return GST_FLOW_NOT_NEGOTIATED;
+    }
+
+    gvision_ptz_update_remap(ptz, view);
+    pool = gvision_ptz_output_pool(view);
+    if (!pool ||
+        gst_buffer_pool_acquire_buffer(pool, &view->output, NULL) !=
+        GST_FLOW_OK) {
+        view->output = NULL;
+        return GST_FLOW_ERROR;
+    }
+    if (!gst_buffer_map(view->output, &view->out_map, GST_MAP_WRITE)) {
+        gst_buffer_unref(view->output);
+        view->output = NULL;
+        return GST_FLOW_ERROR;
+    }
+    return GST_FLOW_OK;
+}
+
+/* Unmap the output of the view, NULL when it has none for the frame */
+static GstBuffer *gvision_ptz_finish_view(GstGVisionPtzPad *view,
+                                          GstBuffer *buf)
+{
+    GstBuffer *output = view->output;
+
+    if (output) {
+        gst_buffer_unmap(output, &view->out_map);
+        /* Timestamps and flags of the input */
+        gst_buffer_copy_into(output, buf, GST_BUFFER_COPY_METADATA, 0, -1);
+        view->output = NULL;
+    }
+    return output;
+}
+
+/**
+ * Caps of the sink pad are those every view takes in any frame size, the
+ * views take those of the upstream peer in any size
+ */
+static gboolean
+gst_gvision_ptz_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  GstGVisionPtz *ptz = GST_GVISION_PTZ (parent);
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CAPS:
+    {
+        GstCaps *filt, *caps, *result;
+
+        gst_query_parse_caps (query, &filt);
+        result = gst_pad_get_pad_template_caps (pad);
+        if (pad == ptz->sinkpad) {
+            GList *views = gvision_ptz_views (ptz);
+
+            for (GList *l = views; l; l = l->next) {
+                GstCaps *peer = gst_pad_peer_query_caps (l->data, NULL);
+                GstCaps *any = gvision_any_size (peer);
+
+                caps = gst_caps_intersect (result, any);
+                gst_caps_unref (any);
+                gst_caps_unref (peer);
+                gst_caps_unref (result);
+                result = caps;
+            }
+            g_list_free_full (views, gst_object_unref);
+        } else {
+            GstCaps *any = filt ? gvision_any_size (filt) : NULL;
+            GstCaps *peer = gst_pad_peer_query_caps (ptz->sinkpad, any);
+
+            caps = gvision_any_size (peer);
+            gst_caps_unref (peer);
+            if (any) {
+                gst_caps_unref (any);
+            }
+            peer = gst_caps_intersect (caps, result);
+            gst_caps_unref (caps);
+            gst_caps_unref (result);
+            result = peer;
+        }
+        if (filt) {
+            caps = gst_caps_intersect_full (filt, result,
+                                            GST_CAPS_INTERSECT_FIRST);
+            gst_caps_unref (result);
+            result = caps;
+        }
+        gst_query_set_caps_result (query, result);
+        gst_caps_unref (result);
+        return TRUE;
+    }
+    case GST_QUERY_ACCEPT_CAPS:
+    {
+        GstCaps *caps, *allowed;
+
+        gst_query_parse_accept_caps (query, &caps);
+        allowed = gst_pad_query_caps (pad, caps);
+        gst_query_set_accept_caps_result (query,
+            gst_caps_can_intersect (caps, allowed));
+        gst_caps_unref (allowed);
+        return TRUE;
+    }
+    default:
+        return gst_pad_query_default (pad, parent, query);
+  }
+}
+
+/* New input caps are kept, every view pushes its own with the next frame */
+static gboolean
+gst_gvision_ptz_sink_event (GstPad * pad, GstObject * parent,
+    GstEvent * event)
+{
+  GstGVisionPtz *ptz = GST_GVISION_PTZ (parent);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+    GList *views = gvision_ptz_views (ptz);
+    GstCaps *caps;
+
+    gst_event_parse_caps (event, &caps);
+    gvision_get_video_caps (&ptz->format, caps);
+    for (GList *l = views; l; l = l->next) {
+      GST_GVISION_PTZ_PAD (l->data)->reconfigure = TRUE;
+    }
+    g_list_free_full (views, gst_object_unref);
+    gst_event_unref (event);
+    return TRUE;
+  }
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP) {
+    gst_flow_combiner_reset (ptz->flow);
+  }
+  return gst_pad_event_default (pad, parent, event);
+}
+
+/**
+ * One map of the input feeds every view: their tables and buffers are set
+ * up first, then all of them are gathered in one pass over the pool
+ */
+static GstFlowReturn
+gst_gvision_ptz_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+    GstGVisionPtz *ptz = GST_GVISION_PTZ (parent);
+    GList *views = gvision_ptz_views(ptz);
+    struct remap_view *frames;
+    unsigned int count = 0;
+    GstFlowReturn ret = GST_FLOW_OK;
+    GstMapInfo map;
+    gboolean mapped;
+
+    if (!ptz->format.width || !ptz->format.height) {
+        g_list_free_full(views, gst_object_unref);
+        gst_buffer_unref(buf);
+        return GST_FLOW_NOT_NEGOTIATED;
+    }
+    if (!ptz->pool) {
+        ptz->pool = pool_create(&ptz->pool_config);
+    }
+
+    frames = g_new(struct remap_view, g_list_length(views) + 1);
+    for (GList *l = views; l; l = l->next) {
+        GstGVisionPtzPad *view = GST_GVISION_PTZ_PAD(l->data);
+        GstFlowReturn res;
+
+        /* Controlled pan, tilt and zoom of the view at the frame time */
+        if (GST_BUFFER_PTS_IS_VALID(buf)) {
+            gst_object_sync_values(GST_OBJECT(view), GST_BUFFER_PTS(buf));
+        }
+        res = gvision_ptz_prepare_view(ptz, view);
+        if (res != GST_FLOW_OK) {
+            ret = gst_flow_combiner_update_pad_flow(ptz->flow, l->data, res);
+            continue;
+        }
+        frames[count].table = view->remap;
+        frames[count].dst   = view->out_map.data;
+        frames[count].out   = &view->format;
+        count++;
+    }
+
+    mapped = count && gst_buffer_map(buf, &map, GST_MAP_READ);
+    if (mapped) {
+        remap_frames(frames, count, map.data, &ptz->format, ptz->interp,
+                     ptz->pool);
+        gst_buffer_unmap(buf, &map);
+    } else if (count) {
+        GST_ELEMENT_ERROR(ptz, RESOURCE, READ,
+                          ("Cannot map the input frame"), (NULL));
+    }
+    g_free(frames);
+
+    for (GList *l = views; l; l = l->next) {
+        GstBuffer *output = gvision_ptz_finish_view(l->data, buf);
+
+        if (!output) {
+            continue;
+        }
+        if (!mapped) {
+            /* Nothing was gathered into it */
+            gst_buffer_unref(output);
+            ret = GST_FLOW_ERROR;
+            continue;
+        }
+        ret = gst_flow_combiner_update_pad_flow(ptz->flow, l->data,
+                                                gst_pad_push(l->data,
+                                                             output));
+    }
+    g_list_free_full(views, gst_object_unref);
+    gst_buffer_unref(buf);
+    return ret;
+}
+
+static GstPad *
+gst_gvision_ptz_request_new_pad (GstElement * element, GstPadTemplate * templ,
+    const gchar * name, const GstCaps * caps)
+{
+  GstGVisionPtz *ptz = GST_GVISION_PTZ (element);
+  gchar *pad_name;
+  GstPad *pad;
+
+  GST_OBJECT_LOCK (ptz);
+  pad_name = name ? g_strdup (name) :
+                    g_strdup_printf ("src_%u", ptz->next_pad++);
+  GST_OBJECT_UNLOCK (ptz);
+
+  pad = g_object_new (GVISION_PTZ_PAD_TYPE, "name", pad_name,
+      "direction", GST_PAD_SRC, "template", templ, NULL);
+  g_free (pad_name);
+  gst_pad_set_query_function (pad, GST_DEBUG_FUNCPTR(gst_gvision_ptz_query));
+
+  /* The flow combiner belongs to the streaming thread */
+  GST_PAD_STREAM_LOCK (ptz->sinkpad);
+  gst_flow_combiner_add_pad (ptz->flow, pad);
+  GST_PAD_STREAM_UNLOCK (ptz->sinkpad);
+
+  gst_pad_set_active (pad, TRUE);
+  if (!gst_element_add_pad (element, pad)) {
+    GST_PAD_STREAM_LOCK (ptz->sinkpad);
+    gst_flow_combiner_remove_pad (ptz->flow, pad);
+    GST_PAD_STREAM_UNLOCK (ptz->sinkpad);
+    gst_object_unref (pad);
+    return NULL;
+  }
+  return pad;
+}
+
+static void
+gst_gvision_ptz_release_pad (GstElement * element, GstPad * pad)
+{
+  GstGVisionPtz *ptz = GST_GVISION_PTZ (element);
+
+  GST_PAD_STREAM_LOCK (ptz->sinkpad);
+  gst_flow_combiner_remove_pad (ptz->flow, pad);
+  GST_PAD_STREAM_UNLOCK (ptz->sinkpad);
+
+  gst_pad_set_active (pad, FALSE);
+  gst_element_remove_pad (element, pad);
+}
+
+static void
+gst_gvision_ptz_pad_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstGVisionPtzPad *view = GST_GVISION_PTZ_PAD (object);
+
+  GST_OBJECT_LOCK (view);
+  switch (prop_id) {
+    case PROP_PAD_PAN:
+      view->pan = g_value_get_float (value);
+      break;
+    case PROP_PAD_TILT:
+      view->tilt = g_value_get_float (value);
+      break;
+    case PROP_PAD_ZOOM:
+      view->zoom = g_value_get_float (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (view);
+}
+
+static void
+gst_gvision_ptz_pad_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstGVisionPtzPad *view = GST_GVISION_PTZ_PAD (object);
+
+  GST_OBJECT_LOCK (view);
+  switch (prop_id) {
+    case PROP_PAD_PAN:
+      g_value_set_float (value, view->pan);
+      break;
+    case PROP_PAD_TILT:
+      g_value_set_float (value, view->tilt);
+      break;
+    case PROP_PAD_ZOOM:
+      g_value_set_float (value, view->zoom);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (view);
+}
+
+static void
+gst_gvision_ptz_pad_finalize (GObject * object)
+{
+  gvision_ptz_release_view (GST_GVISION_PTZ_PAD (object));
+
+  G_OBJECT_CLASS (gst_gvision_ptz_pad_parent_class)->finalize (object);
+}
+
+static void
+gst_gvision_ptz_pad_class_init (GstGVisionPtzPadClass * klass)
+{
+  GObjectClass *gobject_class = (GObjectClass *) klass;
+
+  gobject_class->set_property = gst_gvision_ptz_pad_set_property;
+  gobject_class->get_property = gst_gvision_ptz_pad_get_property;
+  gobject_class->finalize = gst_gvision_ptz_pad_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_PAD_PAN,
+      g_param_spec_float ("pan", "Pan",
+          "Degrees the view is turned around the lens axis",
+          -180.0f, 180.0f, DEFISHEYE_PAN,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_TILT,
+      g_param_spec_float ("tilt", "Tilt",
+          "Degrees the view is turned away from the lens axis",
+          -180.0f, 180.0f, DEFISHEYE_TILT,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+
+  g_object_class_install_property (gobject_class, PROP_PAD_ZOOM,
+      g_param_spec_float ("zoom", "Zoom",
+          "Magnification of the view, cropped around its centre",
+          0.25f, 16.0f, DEFISHEYE_ZOOM,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE));
+}
+
+static void
+gst_gvision_ptz_pad_init (GstGVisionPtzPad * view)
+{
+  view->pan  = DEFISHEYE_PAN;
+  view->tilt = DEFISHEYE_TILT;
+  view->zoom = DEFISHEYE_ZOOM;
+  view->reconfigure = TRUE;
+  memset(&view->format, 0, sizeof(view->format));
+  view->remap    = NULL;
+  view->out_pool = NULL;
+  view->output   = NULL;
+}
+
+static void
+gst_gvision_ptz_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstGVisionPtz *ptz = GST_GVISION_PTZ (object);
+  /* Set by the properties of the pool configuration */
+  gboolean restart = FALSE;
+
+  /* No chain runs in READY, the pool can go */
+  if (!gvision_property_mutable (GST_ELEMENT (ptz), pspec))
+    return;
+
+  switch (prop_id) {
+    case PROP_INTERPOLATION:
+      ptz->interp = g_value_get_enum (value);
+      break;
+    case PROP_MAP_TYPE:
+      ptz->map_type = g_value_get_enum (value);
+      break;
+    case PROP_LENS_MODEL:
+      GST_OBJECT_LOCK (ptz);
+      ptz->lens.model = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (ptz);
+      break;
+    case PROP_FOV:
+      GST_OBJECT_LOCK (ptz);
+      ptz->lens.fov = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (ptz);
+      break;
+    case PROP_VIEW:
+      GST_OBJECT_LOCK (ptz);
+      ptz->lens.view = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (ptz);
+      break;
+    case PROP_CACHE_SIZE:
+      ptz->cache_size = g_value_get_uint (value);
+      remap_cache_limit (ptz->tables, (size_t) ptz->cache_size << 20);
+      break;
+    case PROP_THREADS:
+      ptz->pool_config.threads = g_value_get_uint (value);
+      restart = TRUE;
+      break;
+    case PROP_SHARED_POOL:
+      ptz->pool_config.shared = g_value_get_boolean (value);
+      restart = TRUE;
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      return;
+  }
+
+  if (restart) {
+    /* Not streaming, the pool is started again with the next buffer */
+    pool_destroy (ptz->pool);
+    ptz->pool = NULL;
+  }
+}
+
+static void
+gst_gvision_ptz_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstGVisionPtz *ptz = GST_GVISION_PTZ (object);
+
+  switch (prop_id) {
+    case PROP_INTERPOLATION:
+      g_value_set_enum (value, ptz->interp);
+      break;
+    case PROP_MAP_TYPE:
+      g_value_set_enum (value, ptz->map_type);
+      break;
+    case PROP_LENS_MODEL:
+      g_value_set_enum (value, ptz->lens.model);
+      break;
+    case PROP_FOV:
+      g_value_set_float (value, ptz->lens.fov);
+      break;
+    case PROP_VIEW:
+      g_value_set_float (value, ptz->lens.view);
+      break;
+    case PROP_CACHE_SIZE:
+      g_value_set_uint (value, ptz->cache_size);
+      break;
+    case PROP_THREADS:
+      g_value_set_uint (value, ptz->pool_config.threads);
+      break;
+    case PROP_SHARED_POOL:
+      g_value_set_boolean (value, ptz->pool_config.shared);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_gvision_ptz_finalize (GObject * object)
+{
+  GstGVisionPtz *ptz = GST_GVISION_PTZ (object);
+
+  release_remap_cache(ptz->tables);
+  ptz->tables = NULL;
+  pool_destroy(ptz->pool);
+  ptz->pool = NULL;
+  gst_flow_combiner_free(ptz->flow);
+  ptz->flow = NULL;
+  release_duration_hashmaps();
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static void
+gst_gvision_ptz_class_init (GstGVisionPtzClass * klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *gstelement_class;
+
+  gobject_class = (GObjectClass *) klass;
+  gstelement_class = (GstElementClass *) klass;
+
+  gobject_class->set_property = gst_gvision_ptz_set_property;
+  gobject_class->get_property = gst_gvision_ptz_get_property;
+  gobject_class->finalize = gst_gvision_ptz_finalize;
+
+  gstelement_class->request_new_pad =
+      GST_DEBUG_FUNCPTR (gst_gvision_ptz_request_new_pad);
+  gstelement_class->release_pad =
+      GST_DEBUG_FUNCPTR (gst_gvision_ptz_release_pad);
+
+  g_object_class_install_property (gobject_class, PROP_INTERPOLATION,
+      g_param_spec_enum ("interpolation", "Interpolation",
+          "Sampling of the source image by every view",
+          GST_TYPE_GVISION_INTERPOLATION, INTERP_BILINEAR,
+          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_MAP_TYPE,
+      g_param_spec_enum ("map-type", "Map type",
+          "Storage of the tables of the views, mesh trades accuracy for "
+          "memory and faster builds when a view moves",
+          GST_TYPE_GVISION_MAP_TYPE, MAP_MESH, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_LENS_MODEL,
+      g_param_spec_enum ("lens-model", "Lens model",
+          "Fisheye projection of the input, polynomial is taken as "
+          "equidistant",
+          GST_TYPE_GVISION_LENS_MODEL, LENS_EQUIDISTANT, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_FOV,
+      g_param_spec_float ("fov", "Field of view",
+          "Degrees the fisheye lens covers across the short side of the frame",
+          1.0f, 359.0f, DEFISHEYE_FOV, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_VIEW,
+      g_param_spec_float ("view", "View",
+          "Degrees of every view across its short side at zoom 1",
+          1.0f, 179.0f, DEFISHEYE_VIEW, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_CACHE_SIZE,
+      g_param_spec_uint ("cache-size", "Cache size",
+          "MiB of recently used tables kept in memory, a view going back to "
+          "a direction needs no rebuild, 0 to keep none",
+          0, 1U << 16, GVISION_CACHE_SIZE, G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class, PROP_THREADS,
+      g_param_spec_uint ("threads", "Threads",
+          "Worker threads including the streaming one, 0 for one per CPU",
+          0, CPU_SETSIZE, 0, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  g_object_class_install_property (gobject_class, PROP_SHARED_POOL,
+      g_param_spec_boolean ("shared-pool", "Shared pool",
+          "Run on the worker threads shared by all elements of the process, "
+          "the first one sets them up",
+          FALSE, G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY));
+
+  gst_element_class_set_details_simple(gstelement_class,
+    "Fisheye virtual PTZ",
+    "Filter/Converter/Video",
+    "Rectilinear views of one fisheye input, one per request src pad, "
+    "each turned and zoomed on its own",
+    "Atanas Filipov <it.feel.filipov@gmail.com>");
+
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_pad_template_new_with_gtype ("src_%u", GST_PAD_SRC,
+          GST_PAD_REQUEST, gst_static_caps_get (&src_factory.static_caps),
+          GVISION_PTZ_PAD_TYPE));
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&sink_factory));
+}
+
+static void
+gst_gvision_ptz_init (GstGVisionPtz * ptz)
+{
+  ptz->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  gst_pad_set_event_function (ptz->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_gvision_ptz_sink_event));
+  gst_pad_set_chain_function (ptz->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_gvision_ptz_chain));
+  gst_pad_set_query_function (ptz->sinkpad,
+                              GST_DEBUG_FUNCPTR(gst_gvision_ptz_query));
+  gst_element_add_pad (GST_ELEMENT (ptz), ptz->sinkpad);
+
+  memset(&ptz->format, 0, sizeof(ptz->format));
+  defisheye_default_params(&ptz->lens);
+  ptz->lens.model = LENS_EQUIDISTANT;
+  ptz->interp     = INTERP_BILINEAR;
+  ptz->map_type   = MAP_MESH;
+  ptz->cache_size = GVISION_CACHE_SIZE;
+  ptz->tables     = prepare_remap_cache((size_t) ptz->cache_size << 20);
+  /* The table builds time themselves */
+  prepare_duration_hashmaps(8192);
+
+  /* Started with the first buffer, once the properties are set */
+  pool_default_config(&ptz->pool_config);
+  ptz->pool = NULL;
+
+  ptz->flow     = gst_flow_combiner_new();
+  ptz->next_pad = 0;
+}
@@ -37,6 +37,7 @@
 #include <assert.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 /* TODO: */
 #define MIN_PIXEL_VALUE 0
@@ -44,6 +45,13 @@
 
 extern FILE *gplot_hd;
 
+/* Call sites of the band functions, tuned apart on the pool */
+enum histogram_stage {
+    STAGE_PDF,
+    STAGE_EQUALIZE,
+    STAGE_AUTO_LEVELS
+};
+
 /**
  * You can use ${HONE}.gnuplot init file instead of this initialization
  */
@@ -54,49 +62,16 @@ static const char gnplot_init[] = {
     splot '-' with lines\n"
 };
 
-static uint8_t active_pos = 0;
-
-histo_ptr_t* data_array = NULL;
-
-uint32_t cdf[MAX_HISTO_SIZE];
-
-void prepare_histogram_array(unsigned int count)
-{assert(count);
-
-    data_array = malloc(count * sizeof(histo_ptr_t));
-    if (!data_array) {
-        fprintf(stderr, "Cannot allocate memory pool\n");
-        exit(EXIT_FAILURE);
-    }
-
-    for (unsigned int idx = 0; idx < count; idx++) {
-        data_array[idx] = malloc(MAX_HISTO_SIZE * sizeof(uint16_t));
-        if (!data_array[idx]) {
-            fprintf(stderr, "Cannot allocate memory chunk\n");
-            exit(EXIT_FAILURE);
-        }
-    }
-}
-
-void release_histogram_array(unsigned int count)
-{assert(count);
-
-    if (!data_array) {
-        fprintf(stderr, "Invalid memory pool\n");
-    }
-    for (unsigned int idx = 0; idx < count; idx++) {
-        free(data_array[idx]);
-    }
-}
-
 /* Draw histogram */
-void plot_histograms(FILE* const fh, const uint16_t* const histogram,
+void plot_histograms(FILE* const fh, const uint32_t* const histogram,
                      uint16_t hsize)
 {
     if (!fh) {
         return;
     }
 
+    /* Frames in flight plot from several workers, one plot at a time */
+    flockfile(fh);
     fprintf(fh, "%s", gnplot_init);
     for (unsigned int h = 0; h < HIST_COUNT; h += HIST_STEPS){
         for (unsigned int i = 0; i < hsize; i++){
@@ -107,9 +82,10 @@ void plot_histograms(FILE* const fh, const uint16_t* const histogram,
 
     fflush(fh);
     fprintf(fh, "e\n");
+    funlockfile(fh);
 }
 
-static void compute_cdf(uint32_t* cdf_table, uint16_t* pdf_table,
+static void compute_cdf(uint32_t* cdf_table, uint32_t* pdf_table,
                         uint16_t hsize)
 {assert(cdf_table && pdf_table && hsize);
 
@@ -130,98 +106,278 @@ static void normalize_cdf(uint32_t* cdf_table, uint16_t hsize,
     }
 }
 
-void equalize_histogram(uint8_t* buf, const struct image_format* const fmt)
-{assert(buf && fmt);
+/* Lowest level at which the cumulative count reaches the given percent */
+static uint32_t histogram_percentile(const uint32_t* const pdf_table,
+                                     uint16_t hsize, uint32_t total,
+                                     unsigned int percent)
+{assert(pdf_table && hsize);
 
-#ifdef CALC_TOTAL_DURATION
-    /* start time */
-    TimeNode_t point;
-    point.symbolic = HOOK_ID;
-    init_reference_point(point.symbolic, &point);
-#endif
-    uint8_t color;
-    uint8_t* pixels = buf;
-    uint8_t current_idx = active_pos++ % HIST_COUNT;
-    uint16_t* used_histo = data_array[current_idx];
+    uint64_t limit = (uint64_t)total * percent / 100;
+    uint64_t sum = 0;
 
-    memset(used_histo, 0, MAX_HISTO_SIZE * sizeof(*used_histo));
+    for (unsigned int i = 0; i < hsize; i++) {
+        sum += pdf_table[i];
+        if (sum > limit) {
+            return i;
+        }
+    }
 
-    /* Calculate and display histogram */
-#ifdef MULTI_THREAD
-    calc_histogram_pdf_mt(pixels, fmt, used_histo);
-#else
-    calc_histogram_pdf(pixels, fmt, used_histo);
-#endif
-    plot_histograms(gplot_hd, used_histo, MAX_HISTO_SIZE);
+    return hsize - 1;
+}
 
-    /* Compute the CDF table */
-    compute_cdf(cdf, used_histo, MAX_HISTO_SIZE);
-    /* Normalize the CDF table */
-    normalize_cdf(cdf, MAX_HISTO_SIZE, fmt->width * fmt->height);
+/* Replace every byte of each line with its LUT value */
+static void apply_lut(uint8_t* buf, const struct image_format* const fmt,
+                      const uint8_t* const lut)
+{assert(buf && fmt && lut);
 
-    if (fmt->pixelformat == PIXEL_YV12) {
-        /* Update pixels using equalized histogram */
-        for (unsigned int h = 0; h < fmt->height; h++) {
-            for (unsigned int w = 0; w < fmt->bytesperline; w++) {
-                color = buf[w];
-                buf[w] = cdf[color];
-            }
-            buf += fmt->bytesperline;
+    for (unsigned int h = 0; h < fmt->height; h++) {
+        for (unsigned int w = 0; w < fmt->bytesperline; w++) {
+            buf[w] = lut[buf[w]];
+        }
+        buf += fmt->bytesperline;
+    }
+}
+
+/* Replace the R, G and B bytes of each pixel with their own LUT values */
+static void apply_channel_luts(uint8_t* buf,
+                               const struct image_format* const fmt,
+                               uint8_t luts[3][MAX_HISTO_SIZE])
+{assert(buf && fmt && luts);
+
+    uint8_t bpp = fmt->bytesperline / fmt->width;
+
+    for (unsigned int h = 0; h < fmt->height; h++) {
+        for (unsigned int w = 0; w < fmt->bytesperline; w += bpp) {
+            buf[w + 0] = luts[0][buf[w + 0]];
+            buf[w + 1] = luts[1][buf[w + 1]];
+            buf[w + 2] = luts[2][buf[w + 2]];
         }
+        buf += fmt->bytesperline;
+    }
+}
+
+/**
+ * Arguments of the passes over the lines of a frame
+ */
+struct lut_pass {
+    uint8_t* buf;
+    const struct image_format* fmt;
+    const uint8_t* lut;
+    uint8_t (*luts)[MAX_HISTO_SIZE];
+    const uint32_t* cdf_table;
+};
+
+/* Format and first line of a band of full lines */
+static uint8_t* band_lines(uint8_t* buf, const struct image_format* const fmt,
+                           const struct image_band* const band,
+                           struct image_format* const part)
+{
+    *part = *fmt;
+    part->height = band->height;
+    part->size   = band->height * fmt->bytesperline;
+
+    return buf + band->y * fmt->bytesperline;
+}
+
+static void lut_band(void* arg, const struct image_band* const band,
+                     void* scratch)
+{
+    struct lut_pass* pass = arg;
+    struct image_format part;
+    uint8_t* lines = band_lines(pass->buf, pass->fmt, band, &part);
+
+    if (pass->luts) {
+        apply_channel_luts(lines, &part, pass->luts);
     } else {
-        /* Update pixels using equalized histogram */
-        uint8_t bpp = fmt->bytesperline / fmt->width;
-#ifdef CALC_TOTAL_DURATION
-        /* start time */
-        point.symbolic = HOOK_ID;
-        init_reference_point(point.symbolic, &point);
-#endif
-        for (unsigned int h = 0; h < fmt->height; h++) {
-            for (unsigned int w = 0; w < fmt->bytesperline; w += bpp) {
-                rgb_t in;
-                in.r = buf[w + 0]; in.g = buf[w + 1]; in.b = buf[w + 2];
-                if (fmt->colorspace == COLOR_HSV) {
-                    hsv_t out;
-                    /* Convert pixel from RGB to HSV */
-                    rgb2hsv(&in, &out);
-                    /* Calcualte PDF for V only */
-                    color = out.v * 255.0;
-                    /* Update V */
-                    out.v = cdf[color] / 255.0;
-                    /* Convert pixel from HSV to RGB */
-                    hsv2rgb(&out, &in);
-                } else {
-                    yuv_t out;
-                    /* Convert pixel from RGB to YUV */
-                    rgb2yuv(&in, &out);
-                    /* Calcualte PDF for Y only */
-                    color = out.y;
-                    /* Update Y */
-                    out.y = cdf[color];
-                    /* Convert pixel from YUV to RGB */
-                    yuv2rgb(&out, &in);
-                }
-                /* Update RGB */
-                buf[w + 0] = in.r; buf[w + 1] = in.g; buf[w + 2] = in.b;
+        apply_lut(lines, &part, pass->lut);
+    }
+}
+
+/* One LUT for every byte, or one LUT per R, G and B channel */
+static void lut_pass(uint8_t* buf, const struct image_format* const fmt,
+                     const uint8_t* const lut,
+                     uint8_t luts[3][MAX_HISTO_SIZE],
+                     enum histogram_stage stage,
+                     struct worker_pool* const pool)
+{
+    struct lut_pass pass = {buf, fmt, lut, luts, NULL};
+    struct band_job job = {lut_band, &pass, 0, NULL, stage};
+
+    parallel_for_rows(pool, fmt, &job, 0);
+}
+
+/* Equalize the Y or V of RGB pixels, after the optional white balance */
+static void equalize_rgb_band(void* arg, const struct image_band* const band,
+                              void* scratch)
+{
+    struct lut_pass* pass = arg;
+    struct image_format part;
+    uint8_t* buf = band_lines(pass->buf, pass->fmt, band, &part);
+    uint8_t bpp = part.bytesperline / part.width;
+    uint8_t color;
+
+    for (unsigned int h = 0; h < part.height; h++) {
+        for (unsigned int w = 0; w < part.bytesperline; w += bpp) {
+            rgb_t in;
+            in.r = buf[w + 0]; in.g = buf[w + 1]; in.b = buf[w + 2];
+            if (pass->luts) {
+                /* White balance ahead of the equalization */
+                in.r = pass->luts[0][in.r];
+                in.g = pass->luts[1][in.g];
+                in.b = pass->luts[2][in.b];
             }
-            buf += fmt->bytesperline;
+            if (part.colorspace == COLOR_HSV) {
+                hsv_t out;
+                /* Convert pixel from RGB to HSV */
+                rgb2hsv(&in, &out);
+                /* Calcualte PDF for V only */
+                color = out.v * 255.0;
+                /* Update V */
+                out.v = pass->cdf_table[color] / 255.0;
+                /* Convert pixel from HSV to RGB */
+                hsv2rgb(&out, &in);
+            } else {
+                yuv_t out;
+                /* Convert pixel from RGB to YUV */
+                rgb2yuv(&in, &out);
+                /* Calcualte PDF for Y only */
+                color = out.y;
+                /* Update Y */
+                out.y = pass->cdf_table[color];
+                /* Convert pixel from YUV to RGB */
+                yuv2rgb(&out, &in);
+            }
+            /* Update RGB */
+            buf[w + 0] = in.r; buf[w + 1] = in.g; buf[w + 2] = in.b;
         }
-#ifdef CALC_TOTAL_DURATION
-        /* stop time */
-        init_reference_point(point.symbolic, &point);
-#endif
+        buf += part.bytesperline;
     }
-#ifdef CALC_TOTAL_DURATION
-    /* stop time */
-    init_reference_point(point.symbolic, &point);
-#endif
-    show_reference_delta();
 }
 
-/* Compute the probability density functions (PDF) */
-void calc_histogram_pdf(const uint8_t* const buf,
-                        const struct image_format* const fmt, uint16_t* hresult)
-{assert(buf && fmt && hresult);
+static float channel_mean(const uint32_t* const pdf_table, uint16_t hsize)
+{assert(pdf_table && hsize);
+
+    uint64_t sum = 0;
+    uint64_t count = 0;
+
+    for (unsigned int i = 0; i < hsize; i++) {
+        sum   += (uint64_t)i * pdf_table[i];
+        count += pdf_table[i];
+    }
+
+    return count ? (float)sum / count : 0;
+}
+
+/**
+ * Gray-world scales every channel to the common mean, white-patch scales
+ * the brightest part of every channel to the common white. Returns false
+ * when no correction applies.
+ */
+static bool white_balance_gains(const struct channel_histograms* const channels,
+                                enum white_balance balance, float gains[3])
+{assert(channels && gains);
+
+    const uint32_t* pdf[3] = {channels->red, channels->green, channels->blue};
+    float level[3];
+    float target = 0;
+    uint32_t total = 0;
+
+    for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+        total += channels->green[i];
+    }
+    if (balance == WB_NONE || !total) {
+        return false;
+    }
+
+    for (unsigned int ch = 0; ch < 3; ch++) {
+        if (balance == WB_GRAY_WORLD) {
+            level[ch] = channel_mean(pdf[ch], MAX_HISTO_SIZE);
+            target += level[ch] / 3;
+        } else {
+            level[ch] = histogram_percentile(pdf[ch], MAX_HISTO_SIZE, total,
+                                             BALANCE_WHITE_PERCENT);
+            target = max(target, level[ch]);
+        }
+    }
+
+    for (unsigned int ch = 0; ch < 3; ch++) {
+        float gain = level[ch] > 0.0f ? target / level[ch] : 1.0f;
+        gains[ch] = clamp(gain, BALANCE_MIN_GAIN, BALANCE_MAX_GAIN);
+    }
+
+    return true;
+}
+
+/**
+ * LUTs of the gains of the earlier frames of the stream, false before the
+ * first of them is known or without white balance
+ */
+static bool white_balance_luts(struct levels_state* const state,
+                               enum white_balance balance,
+                               uint8_t luts[3][MAX_HISTO_SIZE])
+{assert(state && luts);
+
+    float gains[3];
+    bool valid;
+
+    pthread_mutex_lock(&state->lock);
+    if (balance == WB_NONE) {
+        /* Starts over once it is switched on again */
+        state->balanced = false;
+    }
+    valid = state->balanced;
+    memcpy(gains, state->gains, sizeof(gains));
+    pthread_mutex_unlock(&state->lock);
+    if (!valid) {
+        return false;
+    }
+
+    for (unsigned int ch = 0; ch < 3; ch++) {
+        for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+            float value = i * gains[ch];
+            luts[ch][i] = min(value, (float)MAX_PIXEL_VALUE) + 0.5f;
+        }
+    }
+    return true;
+}
+
+/* Smooth the gains of this frame into those of the next frames */
+static void white_balance_update(struct levels_state* const state,
+                                 const struct channel_histograms* channels,
+                                 enum white_balance balance)
+{assert(state && channels);
+
+    float gains[3];
+
+    if (!white_balance_gains(channels, balance, gains)) {
+        return;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    for (unsigned int ch = 0; ch < 3; ch++) {
+        if (state->balanced) {
+            state->gains[ch] += (gains[ch] - state->gains[ch]) *
+                                BALANCE_SMOOTHING;
+        } else {
+            state->gains[ch] = gains[ch];
+        }
+    }
+    state->balanced = true;
+    pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Luma or value histogram of RGB pixels taken through the luts when given,
+ * the R, G and B histograms when channels is not NULL. Either histogram
+ * may be left out.
+ */
+static void histogram_lines(const uint8_t* const buf,
+                            const struct image_format* const fmt,
+                            uint32_t* hresult,
+                            struct channel_histograms* channels,
+                            uint8_t luts[3][MAX_HISTO_SIZE],
+                            unsigned int step)
+{assert(buf && fmt && (hresult || channels) && step);
 
     const uint8_t* pixels = buf;
     uint8_t color;
@@ -239,24 +395,36 @@ void calc_histogram_pdf(const uint8_t* const buf,
        fmt->size);
 #endif
     /* calc current historgram */
-    for (uint32_t h = 0; h < fmt->height; h++) {
-        for (uint32_t w = 0; w < fmt->width; w += bpp) {
+    for (uint32_t h = 0; h < fmt->height; h += step) {
+        for (uint32_t w = 0; w < fmt->bytesperline; w += bpp * step) {
             if (fmt->pixelformat == PIXEL_YV12) {
                 color = pixels[w];
             } else {
+                rgb_t in;
+                in.r = pixels[w]; in.g = pixels[w + 1]; in.b = pixels[w + 2];
+                if (channels) {
+                    channels->red[in.r]   += 1;
+                    channels->green[in.g] += 1;
+                    channels->blue[in.b]  += 1;
+                }
+                if (!hresult) {
+                    continue;
+                }
+                if (luts) {
+                    /* White balanced pixel */
+                    in.r = luts[0][in.r];
+                    in.g = luts[1][in.g];
+                    in.b = luts[2][in.b];
+                }
                 if (fmt->colorspace == COLOR_HSV) {
-                    rgb_t in;
                     hsv_t out;
                     /* Convert pixel from RGB to HSV */
-                    in.r = pixels[w]; in.g = pixels[w + 1]; in.b = pixels[w + 2];
                     rgb2hsv(&in, &out);
                     /* Calcualte PDF for V only */
                     color = out.v * 255.0;
                 } else {
-                    rgb_t in;
                     yuv_t out;
                     /* Convert pixel from RGB to YUV */
-                    in.r = pixels[w]; in.g = pixels[w + 1]; in.b = pixels[w + 2];
                     rgb2yuv(&in, &out);
                     /* Calcualte PDF for Y only */
                     color = out.y;
@@ -264,10 +432,321 @@ void calc_histogram_pdf(const uint8_t* const buf,
             }
             hresult[color] += 1;
         }
-        pixels += fmt->bytesperline;
+        pixels += fmt->bytesperline * step;
     }
 #ifdef CALC_PDF_DURATION
     /* stop time */
     init_reference_point(point.symbolic, &point);
 #endif
 }
+
+/**
+ * Private histograms of a thread, added to the results at the end
+ */
+struct histogram_scratch {
+    uint32_t luma[MAX_HISTO_SIZE];
+    struct channel_histograms channels;
+};
+
+struct histogram_pass {
+    const uint8_t* buf;
+    const struct image_format* fmt;
+    uint32_t* hresult;
+    struct channel_histograms* channels;
+    uint8_t (*luts)[MAX_HISTO_SIZE];
+    unsigned int step;
+};
+
+static void histogram_band(void* arg, const struct image_band* const band,
+                           void* scratch)
+{
+    struct histogram_pass* pass = arg;
+    struct histogram_scratch* partial = scratch;
+    struct image_format part = *pass->fmt;
+    /* Keep the sampling grid of the whole frame */
+    uint32_t first = (band->y + pass->step - 1) / pass->step * pass->step;
+    uint32_t last  = band->y + band->height;
+
+    if (first >= last) {
+        return;
+    }
+    /* Overwrite hight and size */
+    part.height = last - first;
+    part.size   = part.height * part.bytesperline;
+
+    histogram_lines(&pass->buf[first * part.bytesperline], &part,
+                    pass->hresult ? partial->luma : NULL,
+                    pass->channels ? &partial->channels : NULL, pass->luts,
+                    pass->step);
+}
+
+static void histogram_reduce(void* arg, void* scratch)
+{
+    struct histogram_pass* pass = arg;
+    struct histogram_scratch* partial = scratch;
+
+    if (pass->hresult) {
+        for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+            pass->hresult[i] += partial->luma[i];
+        }
+    }
+    if (pass->channels) {
+        for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+            pass->channels->red[i]   += partial->channels.red[i];
+            pass->channels->green[i] += partial->channels.green[i];
+            pass->channels->blue[i]  += partial->channels.blue[i];
+        }
+    }
+}
+
+/* Levels of the pixels after the luts when given, on the pool */
+static void histogram_pass_mt(const uint8_t* const buf,
+                              const struct image_format* const fmt,
+                              uint32_t* hresult,
+                              struct channel_histograms* channels,
+                              uint8_t luts[3][MAX_HISTO_SIZE],
+                              unsigned int step, enum histogram_stage stage,
+                              struct worker_pool* const pool)
+{assert(buf && fmt && (hresult || channels) && step);
+
+#ifdef CALC_TOTAL_DURATION
+    /* start time */
+    TimeNode_t point;
+    point.symbolic = HOOK_ID;
+    init_reference_point(point.symbolic, &point);
+#endif
+    struct histogram_pass pass = {buf, fmt, hresult, channels, luts, step};
+    struct band_job job = {
+        histogram_band, &pass, sizeof(struct histogram_scratch),
+        histogram_reduce, stage
+    };
+
+    parallel_for_rows(pool, fmt, &job, 0);
+#ifdef CALC_TOTAL_DURATION
+    /* stop time */
+    init_reference_point(point.symbolic, &point);
+#endif
+}
+
+void calc_histogram_pdf_mt(const uint8_t* const buf,
+                           const struct image_format* const fmt,
+                           uint32_t* hresult,
+                           struct channel_histograms* channels,
+                           unsigned int step, struct worker_pool* const pool)
+{
+    histogram_pass_mt(buf, fmt, hresult, channels, NULL, step, STAGE_PDF,
+                      pool);
+}
+
+void equalize_histogram(uint8_t* buf, const struct image_format* const fmt,
+                        struct levels_state* const state,
+                        enum white_balance balance,
+                        struct worker_pool* const pool)
+{assert(buf && fmt && state);
+
+#ifdef CALC_TOTAL_DURATION
+    /* start time */
+    TimeNode_t point;
+    point.symbolic = HOOK_ID;
+    init_reference_point(point.symbolic, &point);
+#endif
+    /* Own histogram of the call, frames may run concurrently */
+    uint32_t used_histo[MAX_HISTO_SIZE];
+    struct channel_histograms channels;
+    uint8_t wb_luts[3][MAX_HISTO_SIZE];
+    uint32_t cdf[MAX_HISTO_SIZE];
+    bool wb = balance != WB_NONE && fmt->pixelformat == PIXEL_RGB;
+    bool use_wb = white_balance_luts(state, wb ? balance : WB_NONE, wb_luts);
+
+    memset(used_histo, 0, sizeof(used_histo));
+    memset(&channels, 0, sizeof(channels));
+
+    /**
+     * Calculate and display histogram. The CDF is of the pixels balanced
+     * with the gains of the earlier frames, the same pass gathers the
+     * channels of the gains of the next frames.
+     */
+    histogram_pass_mt(buf, fmt, used_histo, wb ? &channels : NULL,
+                      use_wb ? wb_luts : NULL, 1, STAGE_EQUALIZE, pool);
+    if (wb) {
+        white_balance_update(state, &channels, balance);
+    }
+    plot_histograms(gplot_hd, used_histo, MAX_HISTO_SIZE);
+
+    /* Compute the CDF table */
+    compute_cdf(cdf, used_histo, MAX_HISTO_SIZE);
+    /* Normalize the CDF table */
+    normalize_cdf(cdf, MAX_HISTO_SIZE, fmt->width * fmt->height);
+
+    if (fmt->pixelformat == PIXEL_YV12) {
+        uint8_t lut[MAX_HISTO_SIZE];
+        for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+            lut[i] = cdf[i];
+        }
+        /* Update pixels using equalized histogram */
+        lut_pass(buf, fmt, lut, NULL, STAGE_EQUALIZE, pool);
+    } else {
+#ifdef CALC_TOTAL_DURATION
+        /* start time */
+        point.symbolic = HOOK_ID;
+        init_reference_point(point.symbolic, &point);
+#endif
+        /* Update pixels using equalized histogram */
+        struct lut_pass pass = {buf, fmt, NULL, use_wb ? wb_luts : NULL, cdf};
+        struct band_job job = {
+            equalize_rgb_band, &pass, 0, NULL, STAGE_EQUALIZE
+        };
+        parallel_for_rows(pool, fmt, &job, 0);
+#ifdef CALC_TOTAL_DURATION
+        /* stop time */
+        init_reference_point(point.symbolic, &point);
+#endif
+    }
+#ifdef CALC_TOTAL_DURATION
+    /* stop time */
+    init_reference_point(point.symbolic, &point);
+#endif
+    show_reference_delta();
+}
+
+struct levels_state* prepare_levels_state(void)
+{
+    struct levels_state* state = calloc(1, sizeof(*state));
+    if (!state) {
+        fprintf(stderr, "Cannot allocate levels state\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&state->lock, NULL);
+
+    return state;
+}
+
+void release_levels_state(struct levels_state* state)
+{
+    if (!state) {
+        return;
+    }
+    pthread_mutex_destroy(&state->lock);
+    free(state);
+}
+
+void autolevels_histogram(uint8_t* buf, const struct image_format* const fmt,
+                          struct levels_state* const state,
+                          enum white_balance balance,
+                          struct worker_pool* const pool)
+{assert(buf && fmt && state);
+
+#ifdef CALC_TOTAL_DURATION
+    /* start time */
+    TimeNode_t point;
+    point.symbolic = HOOK_ID;
+    init_reference_point(point.symbolic, &point);
+#endif
+    uint8_t lut[MAX_HISTO_SIZE];
+    uint32_t used_histo[MAX_HISTO_SIZE];
+    uint32_t total = 0;
+    struct channel_histograms channels;
+    uint8_t luts[3][MAX_HISTO_SIZE];
+    bool wb = balance != WB_NONE && fmt->pixelformat == PIXEL_RGB;
+    bool use_wb = white_balance_luts(state, wb ? balance : WB_NONE, luts);
+
+    memset(used_histo, 0, sizeof(used_histo));
+    memset(&channels, 0, sizeof(channels));
+
+    /**
+     * A sparse histogram is enough to place the percentiles. They are of
+     * the pixels balanced with the gains of the earlier frames, the same
+     * pass gathers the channels of the gains of the next frames.
+     */
+    histogram_pass_mt(buf, fmt, used_histo, wb ? &channels : NULL,
+                      use_wb ? luts : NULL, LEVELS_SUBSAMPLE,
+                      STAGE_AUTO_LEVELS, pool);
+    if (wb) {
+        white_balance_update(state, &channels, balance);
+    }
+    plot_histograms(gplot_hd, used_histo, MAX_HISTO_SIZE);
+
+    for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+        total += used_histo[i];
+    }
+    if (!total) {
+        return;
+    }
+
+    float low  = histogram_percentile(used_histo, MAX_HISTO_SIZE, total,
+                                      LEVELS_LOW_PERCENT);
+    float high = histogram_percentile(used_histo, MAX_HISTO_SIZE, total,
+                                      LEVELS_HIGH_PERCENT);
+
+    /**
+     * Smooth the endpoints to avoid flicker between frames, frames of one
+     * stream may be processed concurrently
+     */
+    pthread_mutex_lock(&state->lock);
+    if (state->valid) {
+        state->low  += (low  - state->low)  * LEVELS_SMOOTHING;
+        state->high += (high - state->high) * LEVELS_SMOOTHING;
+    } else {
+        state->low   = low;
+        state->high  = high;
+        state->valid = true;
+    }
+    low  = state->low;
+    high = state->high;
+    pthread_mutex_unlock(&state->lock);
+
+    /* Linear stretch of [low, high] to the full range */
+    float range = max(high - low, 1.0f);
+    float scale = MAX_PIXEL_VALUE / range;
+    for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+        float value = (i - low) * scale;
+        lut[i] = clamp(value, (float)MIN_PIXEL_VALUE, (float)MAX_PIXEL_VALUE)
+                 + 0.5f;
+    }
+
+    /**
+     * YV12 stretches the Y plane only, RGB stretches every channel with
+     * the same LUT, which stretches the luma the same way
+     */
+    if (use_wb) {
+        /* Fold the white balance gains into one LUT per channel */
+        for (unsigned int ch = 0; ch < 3; ch++) {
+            for (unsigned int i = 0; i < MAX_HISTO_SIZE; i++) {
+                luts[ch][i] = lut[luts[ch][i]];
+            }
+        }
+        lut_pass(buf, fmt, NULL, luts, STAGE_AUTO_LEVELS, pool);
+    } else {
+        lut_pass(buf, fmt, lut, NULL, STAGE_AUTO_LEVELS, pool);
+    }
+
+#ifdef CALC_TOTAL_DURATION
+    /* stop time */
+    init_reference_point(point.symbolic, &point);
+#endif
+    show_reference_delta();
+}
+
+/* Compute the probability density functions (PDF) */
+void calc_histogram_pdf(const uint8_t* const buf,
+                        const struct image_format* const fmt, uint32_t* hresult)
+{
+    calc_histogram_pdf_step(buf, fmt, hresult, 1);
+}
+
+void calc_histogram_pdf_step(const uint8_t* const buf,
+                             const struct image_format* const fmt,
+                             uint32_t* hresult, unsigned int step)
+{
+    calc_histogram_pdf_channels(buf, fmt, hresult, NULL, step);
+}
+
+void calc_histogram_pdf_channels(const uint8_t* const buf,
+                                 const struct image_format* const fmt,
+                                 uint32_t* hresult,
+                                 struct channel_histograms* channels,
+                                 unsigned int step)
+{assert(hresult);
+
+    histogram_lines(buf, fmt, hresult, channels, NULL, step);
+}
@@ -0,0 +1,1373 @@
+/**
+ * Copyright (c) 2017 Atanas Filipov <it.feel.filipov@gmail.com>.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "remap/gvision_remap.h"
+#include "gvision_common.h"
+#include "gvision_multithread.h"
+#include "hashmap/cutils/hashmap.h"
+#include "hashmap/gvision_hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REMAP_AVX2
+#endif
+
+/* Entries of the sample grid, a mesh keeps one more past the last sample */
+static void remap_grid(struct remap_table* table)
+{
+    const uint32_t width  = table->width  << table->sample_shift;
+    const uint32_t height = table->height << table->sample_shift;
+
+    table->cols = width;
+    table->rows = height;
+    if (table->mesh_shift) {
+        table->cols = ((width  - 1) >> table->mesh_shift) + 2;
+        table->rows = ((height - 1) >> table->mesh_shift) + 2;
+    }
+}
+
+struct remap_table* prepare_remap_table(uint32_t width, uint32_t height,
+                                        uint32_t src_width,
+                                        uint32_t src_height,
+                                        uint32_t mesh_shift,
+                                        uint32_t sample_shift)
+{assert(width && height && src_width && src_height);
+ assert(mesh_shift <= 5 && sample_shift <= REMAP_MAX_SAMPLE_SHIFT);
+
+    struct remap_table* table = calloc(1, sizeof(*table));
+    if (!table) {
+        fprintf(stderr, "Cannot allocate remap table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    table->width      = width;
+    table->height     = height;
+    table->src_width  = src_width;
+    table->src_height = src_height;
+    table->mesh_shift = mesh_shift;
+    table->sample_shift = sample_shift;
+    table->refs       = 1;
+    remap_grid(table);
+    table->coords     = malloc(remap_table_size(table));
+    if (!table->coords) {
+        fprintf(stderr, "Cannot allocate remap coordinates\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return table;
+}
+
+void prepare_remap_chroma(struct remap_table* table)
+{assert(table && !table->chroma);
+
+    table->chroma = prepare_remap_table(
+        max(table->width >> 1, 1U), max(table->height >> 1, 1U),
+        max(table->src_width >> 1, 1U), max(table->src_height >> 1, 1U),
+        table->mesh_shift, table->sample_shift);
+}
+
+/* Fixed point position inside [0, size - 1] */
+static int32_t remap_fixed(float pos, uint32_t size)
+{
+    const float limit = (float)(size - 1);
+
+    /* Also catches NaN */
+    if (!(pos > 0.0f)) {
+        return 0;
+    }
+    if (pos > limit) {
+        pos = limit;
+    }
+    return (int32_t)lrintf(pos * REMAP_ONE);
+}
+
+struct remap_build {
+    struct remap_table* table;
+    remap_func_t func;
+    void* arg;
+};
+
+/**
+ * Entries of a band of full rows, grid points of a mesh. Sample i of the
+ * grid lies at (i + 0.5) / samples - 0.5 in destination pixels.
+ */
+static void remap_build_band(void* arg, const struct image_band* const band,
+                             void* scratch)
+{
+    const struct remap_build* build = arg;
+    struct remap_table* table = build->table;
+    const uint32_t shift = table->mesh_shift;
+    const float scale  = 1.0f / (float)(1U << table->sample_shift);
+    const float offset = 0.5f * scale - 0.5f;
+    struct remap_coord* coord = table->coords +
+                                (size_t)band->y * table->cols;
+
+    for (uint32_t y = band->y; y < band->y + band->height; y++) {
+        for (uint32_t x = 0; x < table->cols; x++, coord++) {
+            float sx, sy;
+            build->func(build->arg, (float)(x << shift) * scale + offset,
+                        (float)(y << shift) * scale + offset, &sx, &sy);
+            coord->x = remap_fixed(sx, table->src_width);
+            coord->y = remap_fixed(sy, table->src_height);
+        }
+    }
+}
+
+/* Chroma sample (x, y) through the luma function, both centre sited */
+static void remap_chroma_point(void* arg, float x, float y, float* sx,
+                               float* sy)
+{
+    const struct remap_build* build = arg;
+
+    build->func(build->arg, 2.0f * x + 0.5f, 2.0f * y + 0.5f, sx, sy);
+    *sx = (*sx - 0.5f) * 0.5f;
+    *sy = (*sy - 0.5f) * 0.5f;
+}
+
+void build_remap_table(struct remap_table* table, remap_func_t func,
+                       void* arg, struct worker_pool* pool)
+{assert(table && func);
+
+    struct remap_build build = {table, func, arg};
+    struct band_job job = {remap_build_band, &build, 0, NULL, 0};
+    struct image_format fmt = {0};
+    unsigned int threads = pool ? pool_size(pool) : 1;
+
+    fmt.width  = table->cols;
+    fmt.height = table->rows;
+    /* Built once per format, the tuner is kept for the frame stages */
+    parallel_for_rows(pool, &fmt, &job,
+                      max(table->rows / (threads * POOL_CHUNKS_PER_THREAD),
+                          1U));
+    if (table->chroma) {
+        build_remap_table(table->chroma, remap_chroma_point, &build, pool);
+    }
+}
+
+/**
+ * Positions of count destination pixels of row y, from x on every step-th
+ * one. The mesh rows are blended per column first, the pixels between two
+ * columns are then stepped along their difference.
+ */
+static void remap_mesh_row(const struct remap_table* table, uint32_t x,
+                           uint32_t y, uint32_t step, uint32_t count,
+                           struct remap_coord* out)
+{
+    const uint32_t shift = table->mesh_shift;
+    const int32_t  cell  = 1 << shift;
+    const int32_t  half  = cell >> 1;
+    const int32_t  fy    = y & (cell - 1);
+    const uint32_t first = x >> shift;
+    const uint32_t last  = ((x + (count - 1) * step) >> shift) + 1;
+    const struct remap_coord* top = table->coords +
+                                    (size_t)(y >> shift) * table->cols;
+    const struct remap_coord* bottom = top + table->cols;
+    /* Vertical pass of the columns the pixels fall in between */
+    struct remap_coord column[REMAP_TILE_WIDTH + 2];
+
+    for (uint32_t c = first; c <= last; c++) {
+        column[c - first].x = (top[c].x * (cell - fy) + bottom[c].x * fy +
+                               half) >> shift;
+        column[c - first].y = (top[c].y * (cell - fy) + bottom[c].y * fy +
+                               half) >> shift;
+    }
+    for (uint32_t i = 0; i < count;) {
+        const struct remap_coord* left = &column[(x >> shift) - first];
+        const int32_t  dx  = left[1].x - left[0].x;
+        const int32_t  dy  = left[1].y - left[0].y;
+        const int32_t  fx  = x & (cell - 1);
+        const int32_t  sx  = (left[0].x << shift) + dx * fx + half;
+        const int32_t  sy  = (left[0].y << shift) + dy * fx + half;
+        /* Pixels up to the next column */
+        const uint32_t n   = min((cell - fx + step - 1) / step, count - i);
+
+        uint32_t k = 0;
+#ifdef __SSE2__
+        /* Two pixels per vector, x and y side by side */
+        const int32_t ddx = dx * (int32_t)step;
+        const int32_t ddy = dy * (int32_t)step;
+        const __m128i bits = _mm_cvtsi32_si128(shift);
+        const __m128i next = _mm_setr_epi32(2 * ddx, 2 * ddy, 2 * ddx,
+                                            2 * ddy);
+        __m128i pos = _mm_setr_epi32(sx, sy, sx + ddx, sy + ddy);
+
+        for (; k + 2 <= n; k += 2) {
+            _mm_storeu_si128((__m128i*)(out + i + k), _mm_sra_epi32(pos, bits));
+            pos = _mm_add_epi32(pos, next);
+        }
+#endif
+        for (; k < n; k++) {
+            out[i + k].x = (sx + dx * (int32_t)(k * step)) >> shift;
+            out[i + k].y = (sy + dy * (int32_t)(k * step)) >> shift;
+        }
+        i += n;
+        x += n * step;
+    }
+}
+
+void remap_lookup(const struct remap_table* table, uint32_t x, uint32_t y,
+                  struct remap_coord* coord)
+{assert(table && coord);
+ assert(x < table->width  << table->sample_shift &&
+        y < table->height << table->sample_shift);
+
+    if (table->mesh_shift) {
+        remap_mesh_row(table, x, y, 1, 1, coord);
+    } else {
+        *coord = table->coords[(size_t)y * table->cols + x];
+    }
+}
+
+size_t remap_table_size(const struct remap_table* table)
+{assert(table);
+
+    return (size_t)table->cols * table->rows * sizeof(*table->coords) +
+           (table->chroma ? remap_table_size(table->chroma) : 0);
+}
+
+/* Nearest source pixel of a table entry */
+static inline uint32_t remap_round(int32_t pos)
+{
+    return (uint32_t)(pos + (REMAP_ONE >> 1)) >> REMAP_FRAC_BITS;
+}
+
+/**
+ * One plane of a frame. Subsampled planes without a table of their own read
+ * every step-th table entry and scale the positions down by shift.
+ */
+struct remap_plane {
+    const struct remap_table* table;
+    const uint8_t* src;
+    uint32_t sstride;
+    /* Source plane in pixels */
+    uint32_t swidth;
+    uint32_t sheight;
+    uint8_t* dst;
+    uint32_t dstride;
+    uint32_t bpp;
+    uint32_t step;
+    uint32_t shift;
+    /* Log2 of the frame size against the plane size */
+    uint32_t subsample;
+    bool stream;
+    bool avx2;
+    enum interpolation interp;
+};
+
+/* Catmull-Rom weights of the four taps for every fractional position */
+static int16_t cubic_weights[REMAP_ONE][4];
+static pthread_once_t cubic_once = PTHREAD_ONCE_INIT;
+
+/* Table entry of the plane pixel (x, y) */
+static inline const struct remap_coord* remap_entry(
+    const struct remap_table* table, const struct remap_plane* plane,
+    uint32_t x, uint32_t y)
+{
+    return table->coords + (size_t)y * plane->step * table->cols +
+           x * plane->step;
+}
+
+/* Source lines a row of the tile reads, fetched ahead of the gather */
+static void remap_prefetch(const struct remap_table* table,
+                           const struct remap_plane* plane, uint32_t x,
+                           uint32_t y, uint32_t width)
+{
+    const uint32_t samples = table->sample_shift;
+    const uint32_t ty = (y * plane->step) << samples;
+    struct remap_coord first, mid, last;
+
+    /* First samples of the pixels */
+    remap_lookup(table, (x * plane->step) << samples, ty, &first);
+    remap_lookup(table, ((x + (width >> 1)) * plane->step) << samples, ty,
+                 &mid);
+    remap_lookup(table, ((x + width - 1) * plane->step) << samples, ty,
+                 &last);
+
+    uint32_t x0 = remap_round(min(min(first.x, mid.x), last.x)) >>
+                  plane->shift;
+    uint32_t x1 = remap_round(max(max(first.x, mid.x), last.x)) >>
+                  plane->shift;
+    uint32_t y0 = remap_round(min(min(first.y, mid.y), last.y)) >>
+                  plane->shift;
+    uint32_t y1 = remap_round(max(max(first.y, mid.y), last.y)) >>
+                  plane->shift;
+
+    y1 = min(y1, y0 + REMAP_PREFETCH_SPAN - 1);
+    for (uint32_t sy = y0; sy <= y1; sy++) {
+        const uint8_t* row = plane->src + (size_t)sy * plane->sstride;
+        for (uint32_t sx = x0 * plane->bpp; sx <= x1 * plane->bpp;
+             sx += CACHE_LINE_SIZE) {
+            __builtin_prefetch(row + sx, 0, 3);
+        }
+    }
+}
+
+/**
+ * Copy a gathered row out. Large planes bypass the caches for the whole
+ * cache lines of the row, partial lines would be read back for the merge.
+ */
+static inline void remap_store(uint8_t* dst, const uint8_t* line,
+                               uint32_t bytes, bool stream)
+{
+#ifdef __SSE2__
+    uint32_t head = -(uintptr_t)dst & (CACHE_LINE_SIZE - 1);
+
+    if (stream && bytes >= head + CACHE_LINE_SIZE) {
+        memcpy(dst, line, head);
+        dst   += head;
+        line  += head;
+        bytes -= head;
+        for (; bytes >= CACHE_LINE_SIZE; bytes -= CACHE_LINE_SIZE,
+             dst += CACHE_LINE_SIZE, line += CACHE_LINE_SIZE) {
+            for (unsigned int i = 0; i < CACHE_LINE_SIZE; i += 16) {
+                _mm_stream_si128((__m128i*)(dst + i),
+                                 _mm_loadu_si128((const __m128i*)(line + i)));
+            }
+        }
+    }
+#endif
+    memcpy(dst, line, bytes);
+}
+
+static void remap_cubic_init(void)
+{
+    const float a = -0.5f;
+    const int32_t one = 1 << REMAP_CUBIC_BITS;
+
+    for (int32_t f = 0; f < REMAP_ONE; f++) {
+        const float t = (float)f / REMAP_ONE;
+        const float dist[4] = {1.0f + t, t, 1.0f - t, 2.0f - t};
+        int32_t sum = 0;
+
+        for (unsigned int i = 0; i < 4; i++) {
+            const float d = dist[i];
+            float w = d <= 1.0f ? ((a + 2.0f) * d - (a + 3.0f)) * d * d + 1.0f :
+                      ((a * d - 5.0f * a) * d + 8.0f * a) * d - 4.0f * a;
+            cubic_weights[f][i] = (int16_t)lrintf(w * one);
+            sum += cubic_weights[f][i];
+        }
+        /* Flat areas stay flat */
+        cubic_weights[f][1] += one - sum;
+    }
+}
+
+/* Nearest neighbour gather of width pixels */
+static inline void remap_gather(const struct remap_coord* coord,
+                                const uint8_t* src, uint32_t sstride,
+                                uint32_t bpp, uint32_t step, uint32_t shift,
+                                uint8_t* out, uint32_t width)
+{
+    for (uint32_t i = 0; i < width; i++, coord += step) {
+        const uint8_t* in = src +
+            (size_t)(remap_round(coord->y) >> shift) * sstride +
+            (remap_round(coord->x) >> shift) * bpp;
+        for (uint32_t c = 0; c < bpp; c++) {
+            *out++ = in[c];
+        }
+    }
+}
+
+/**
+ * Bilinear sample, both passes in fixed point with 4 fractional bits kept
+ * in between. p01 and p11 are only read with a non-zero weight when the
+ * right or bottom neighbour exists.
+ */
+static inline uint8_t remap_lerp(uint32_t p00, uint32_t p01, uint32_t p10,
+                                 uint32_t p11, uint32_t fx, uint32_t fy)
+{
+    uint32_t t = (p00 * (REMAP_ONE - fx) + p01 * fx + 8) >> 4;
+    uint32_t b = (p10 * (REMAP_ONE - fx) + p11 * fx + 8) >> 4;
+    return (t * (REMAP_ONE - fy) + b * fy + (1 << (2 * REMAP_FRAC_BITS - 5)))
+           >> (2 * REMAP_FRAC_BITS - 4);
+}
+
+/* Bilinear interpolation of width pixels */
+static inline void remap_bilinear(const struct remap_coord* coord,
+                                  const struct remap_plane* plane,
+                                  uint32_t bpp, uint32_t step, uint8_t* out,
+                                  uint32_t width)
+{
+    const uint8_t* src = plane->src;
+    const uint32_t sstride = plane->sstride;
+    const uint32_t shift = plane->shift;
+    const uint32_t xmax  = plane->swidth  - 1;
+    const uint32_t ymax  = plane->sheight - 1;
+
+    for (uint32_t i = 0; i < width; i++, coord += step) {
+        const uint32_t cx = (uint32_t)coord->x >> shift;
+        const uint32_t cy = (uint32_t)coord->y >> shift;
+        const uint32_t x0 = cx >> REMAP_FRAC_BITS;
+        const uint32_t y0 = cy >> REMAP_FRAC_BITS;
+        const uint32_t fx = cx & (REMAP_ONE - 1);
+        const uint32_t fy = cy & (REMAP_ONE - 1);
+        const uint8_t* p0 = src + (size_t)y0 * sstride + x0 * bpp;
+        const uint8_t* p1 = y0 < ymax ? p0 + sstride : p0;
+        const uint32_t dx = x0 < xmax ? bpp : 0;
+
+        for (uint32_t c = 0; c < bpp; c++) {
+            *out++ = remap_lerp(p0[c], p0[c + dx], p1[c], p1[c + dx], fx, fy);
+        }
+    }
+}
+
+#ifdef REMAP_AVX2
+/**
+ * Bilinear interpolation of 8 pixels at a time of a single byte plane read
+ * through full resolution entries. One 32 bit gather per row fetches both
+ * horizontal neighbours. Positions clamped by the table have a zero weight
+ * on the missing neighbour, groups reading past the plane are left to the
+ * scalar code. Returns the pixels done.
+ */
+__attribute__((target("avx2")))
+static uint32_t remap_bilinear_avx2(const struct remap_coord* coord,
+                                    const struct remap_plane* plane,
+                                    uint8_t* out, uint32_t width)
+{
+    const __m256i stride = _mm256_set1_epi32(plane->sstride);
+    const __m256i ymax   = _mm256_set1_epi32(plane->sheight - 1);
+    /* Last offset a 4 byte read may start at */
+    const __m256i limit  = _mm256_set1_epi32(plane->sstride *
+                                             (plane->sheight - 1) +
+                                             plane->swidth - 4);
+    const __m256i frac   = _mm256_set1_epi32(REMAP_ONE - 1);
+    const __m256i one    = _mm256_set1_epi32(REMAP_ONE);
+    const __m256i bytes  = _mm256_set1_epi32(0xff);
+    const __m256i round  = _mm256_set1_epi32(1 << (2 * REMAP_FRAC_BITS - 5));
+    const __m256i split  = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256i lows   = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const int* src = (const int*)plane->src;
+    uint32_t i = 0;
+
+    for (; i + 8 <= width; i += 8, coord += 8) {
+        __m256i c0 = _mm256_permutevar8x32_epi32(
+            _mm256_loadu_si256((const __m256i*)coord), split);
+        __m256i c1 = _mm256_permutevar8x32_epi32(
+            _mm256_loadu_si256((const __m256i*)(coord + 4)), split);
+        __m256i x  = _mm256_permute2x128_si256(c0, c1, 0x20);
+        __m256i y  = _mm256_permute2x128_si256(c0, c1, 0x31);
+        __m256i iy = _mm256_srli_epi32(y, REMAP_FRAC_BITS);
+        __m256i fx = _mm256_and_si256(x, frac);
+        __m256i fy = _mm256_and_si256(y, frac);
+        __m256i o0 = _mm256_add_epi32(_mm256_mullo_epi32(iy, stride),
+                                      _mm256_srli_epi32(x, REMAP_FRAC_BITS));
+        __m256i o1 = _mm256_add_epi32(o0, _mm256_and_si256(
+                         _mm256_cmpgt_epi32(ymax, iy), stride));
+
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(o1, limit))) {
+            break;
+        }
+        __m256i g0 = _mm256_i32gather_epi32(src, o0, 1);
+        __m256i g1 = _mm256_i32gather_epi32(src, o1, 1);
+        __m256i wx = _mm256_sub_epi32(one, fx);
+
+        /* Products stay below 16 bits */
+        __m256i t = _mm256_add_epi32(
+            _mm256_mullo_epi16(_mm256_and_si256(g0, bytes), wx),
+            _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(g0, 8),
+                                                bytes), fx));
+        __m256i b = _mm256_add_epi32(
+            _mm256_mullo_epi16(_mm256_and_si256(g1, bytes), wx),
+            _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(g1, 8),
+                                                bytes), fx));
+        t = _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_set1_epi32(8)), 4);
+        b = _mm256_srli_epi32(_mm256_add_epi32(b, _mm256_set1_epi32(8)), 4);
+
+        /* Top and bottom in 16 bit halves against their weights */
+        __m256i v = _mm256_madd_epi16(
+            _mm256_or_si256(t, _mm256_slli_epi32(b, 16)),
+            _mm256_or_si256(_mm256_sub_epi32(one, fy),
+                            _mm256_slli_epi32(fy, 16)));
+        v = _mm256_srli_epi32(_mm256_add_epi32(v, round),
+                              2 * REMAP_FRAC_BITS - 4);
+        v = _mm256_shuffle_epi8(v, lows);
+        _mm_storel_epi64((__m128i*)(out + i), _mm_unpacklo_epi32(
+            _mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    }
+    return i;
+}
+#endif
+
+/* Bicubic interpolation of width pixels over 4x4 clamped taps */
+static void remap_bicubic(const struct remap_coord* coord,
+                          const struct remap_plane* plane, uint32_t step,
+                          uint8_t* out, uint32_t width)
+{
+    const uint32_t bpp   = plane->bpp;
+    const uint32_t shift = plane->shift;
+    const int32_t xmax   = plane->swidth  - 1;
+    const int32_t ymax   = plane->sheight - 1;
+
+    for (uint32_t i = 0; i < width; i++, coord += step) {
+        const int32_t cx = coord->x >> shift;
+        const int32_t cy = coord->y >> shift;
+        const int32_t x0 = cx >> REMAP_FRAC_BITS;
+        const int32_t y0 = cy >> REMAP_FRAC_BITS;
+        const int16_t* wx = cubic_weights[cx & (REMAP_ONE - 1)];
+        const int16_t* wy = cubic_weights[cy & (REMAP_ONE - 1)];
+        const uint8_t* rows[4];
+        uint32_t cols[4];
+
+        for (int32_t j = 0; j < 4; j++) {
+            rows[j] = plane->src +
+                      (size_t)clamp(y0 + j - 1, 0, ymax) * plane->sstride;
+            cols[j] = clamp(x0 + j - 1, 0, xmax) * bpp;
+        }
+        for (uint32_t c = 0; c < bpp; c++) {
+            int32_t sum = 0;
+            for (unsigned int j = 0; j < 4; j++) {
+                int32_t h = 0;
+                for (unsigned int n = 0; n < 4; n++) {
+                    h += wx[n] * rows[j][cols[n] + c];
+                }
+                sum += wy[j] * h;
+            }
+            sum = (sum + (1 << (2 * REMAP_CUBIC_BITS - 1))) >>
+                  (2 * REMAP_CUBIC_BITS);
+            *out++ = clamp(sum, 0, 255);
+        }
+    }
+}
+
+/**
+ * Interpolate width pixels at every step-th position into line. Inlined in
+ * both tile loops to keep the kernel picked per row cheap.
+ */
+static inline __attribute__((always_inline))
+void remap_row(const struct remap_coord* coord,
+               const struct remap_plane* plane, uint32_t step, uint8_t* line,
+               uint32_t width)
+{
+    /* Locals, the byte stores below may alias the plane */
+    const uint8_t* src  = plane->src;
+    const uint32_t sstride = plane->sstride;
+    const uint32_t bpp  = plane->bpp;
+
+    if (plane->interp == INTERP_BILINEAR) {
+        if (bpp == 1 && step == 1 && !plane->shift) {
+            uint32_t done = 0;
+#ifdef REMAP_AVX2
+            if (plane->avx2) {
+                done = remap_bilinear_avx2(coord, plane, line, width);
+            }
+#endif
+            remap_bilinear(coord + done, plane, 1, 1, line + done,
+                           width - done);
+        } else if (bpp == 1) {
+            remap_bilinear(coord, plane, 1, step, line, width);
+        } else if (bpp == 3) {
+            remap_bilinear(coord, plane, 3, 1, line, width);
+        } else {
+            remap_bilinear(coord, plane, bpp, step, line, width);
+        }
+    } else if (plane->interp == INTERP_BICUBIC) {
+        remap_bicubic(coord, plane, step, line, width);
+    } else if (bpp == 1 && step == 1 && !plane->shift) {
+        /* Constant arguments for the common layouts */
+        remap_gather(coord, src, sstride, 1, 1, 0, line, width);
+    } else if (bpp == 1) {
+        remap_gather(coord, src, sstride, 1, step, plane->shift, line,
+                     width);
+    } else if (bpp == 3) {
+        remap_gather(coord, src, sstride, 3, 1, 0, line, width);
+    } else {
+        remap_gather(coord, src, sstride, bpp, step, plane->shift, line,
+                     width);
+    }
+}
+
+/* Gather of one output tile, row by row */
+static void remap_tile(const struct remap_table* table,
+                       const struct remap_plane* plane, uint32_t x,
+                       uint32_t y, uint32_t width, uint32_t height)
+{
+    uint8_t line[REMAP_TILE_WIDTH * REMAP_MAX_BPP]
+        __attribute__((aligned(16)));
+    /* Positions of a row interpolated from the mesh */
+    struct remap_coord mesh[REMAP_TILE_WIDTH];
+    const uint32_t bpp  = plane->bpp;
+    const uint32_t step = table->mesh_shift ? 1 : plane->step;
+
+    for (uint32_t row = y; row < y + height; row++) {
+        const struct remap_coord* coord = mesh;
+
+        if (table->mesh_shift) {
+            remap_mesh_row(table, x * plane->step, row * plane->step,
+                           plane->step, width, mesh);
+        } else {
+            coord = remap_entry(table, plane, x, row);
+        }
+
+        if (row + REMAP_PREFETCH_ROWS < y + height) {
+            remap_prefetch(table, plane, x, row + REMAP_PREFETCH_ROWS, width);
+        }
+        remap_row(coord, plane, step, line, width);
+        remap_store(plane->dst + (size_t)row * plane->dstride + x * bpp,
+                    line, width * bpp, plane->stream);
+    }
+}
+
+/**
+ * Gather of one output tile of a sampled table, the area average of the
+ * samples of every pixel. Sample rows are interpolated a tile width at a
+ * time and summed into the pixels they fall in.
+ */
+static void remap_tile_sampled(const struct remap_table* table,
+                               const struct remap_plane* plane, uint32_t x,
+                               uint32_t y, uint32_t width, uint32_t height)
+{
+    uint8_t line[REMAP_TILE_WIDTH * REMAP_MAX_BPP]
+        __attribute__((aligned(16)));
+    uint8_t out[REMAP_TILE_WIDTH * REMAP_MAX_BPP]
+        __attribute__((aligned(16)));
+    uint16_t sum[REMAP_TILE_WIDTH * REMAP_MAX_BPP];
+    struct remap_coord mesh[REMAP_TILE_WIDTH];
+    const uint32_t shift = table->sample_shift;
+    const uint32_t count = width << shift;
+    const uint32_t bpp   = plane->bpp;
+    const uint32_t bytes = width * bpp;
+
+    for (uint32_t row = y; row < y + height; row++) {
+        memset(sum, 0, bytes * sizeof(*sum));
+        if (row + REMAP_PREFETCH_ROWS < y + height) {
+            remap_prefetch(table, plane, x, row + REMAP_PREFETCH_ROWS, width);
+        }
+        for (uint32_t sy = row << shift; sy < (row + 1) << shift; sy++) {
+            for (uint32_t c = 0; c < count; c += REMAP_TILE_WIDTH) {
+                const uint32_t sx = (x << shift) + c;
+                const uint32_t n  = min(REMAP_TILE_WIDTH, count - c);
+                const struct remap_coord* coord = mesh;
+
+                if (table->mesh_shift) {
+                    remap_mesh_row(table, sx, sy, 1, n, mesh);
+                } else {
+                    coord = table->coords + (size_t)sy * table->cols + sx;
+                }
+                remap_row(coord, plane, 1, line, n);
+                for (uint32_t i = 0; i < n; i++) {
+                    uint16_t* pixel = sum + ((c + i) >> shift) * bpp;
+                    for (uint32_t k = 0; k < bpp; k++) {
+                        pixel[k] += line[i * bpp + k];
+                    }
+                }
+            }
+        }
+        for (uint32_t i = 0; i < bytes; i++) {
+            out[i] = (sum[i] + (1U << (2 * shift - 1))) >> (2 * shift);
+        }
+        remap_store(plane->dst + (size_t)row * plane->dstride + x * bpp,
+                    out, bytes, plane->stream);
+    }
+}
+
+/* Tiles of the band in row major order */
+static void remap_band(const struct remap_table* table,
+                       const struct remap_plane* plane,
+                       const struct image_band* band)
+{
+    const uint32_t right  = band->x + band->width;
+    const uint32_t bottom = band->y + band->height;
+
+    for (uint32_t y = band->y; y < bottom; y += REMAP_TILE_HEIGHT) {
+        /* The source rows of the first tile row */
+        for (uint32_t r = y; r < min(y + REMAP_PREFETCH_ROWS, bottom); r++) {
+            remap_prefetch(table, plane, band->x, r,
+                           min(REMAP_TILE_WIDTH, band->width));
+        }
+        for (uint32_t x = band->x; x < right; x += REMAP_TILE_WIDTH) {
+            if (table->sample_shift) {
+                remap_tile_sampled(table, plane, x, y,
+                                   min(REMAP_TILE_WIDTH, right - x),
+                                   min(REMAP_TILE_HEIGHT, bottom - y));
+            } else {
+                remap_tile(table, plane, x, y,
+                           min(REMAP_TILE_WIDTH, right - x),
+                           min(REMAP_TILE_HEIGHT, bottom - y));
+            }
+        }
+    }
+}
+
+/**
+ * Planes of a frame. Bands are given in frame pixels, subsampled planes
+ * take the pixels between the scaled band edges.
+ */
+struct remap_run {
+    struct remap_plane plane[3];
+    unsigned int planes;
+};
+
+static void remap_frame_band(void* arg, const struct image_band* const band,
+                             void* scratch)
+{
+    const struct remap_run* run = arg;
+
+    for (unsigned int p = 0; p < run->planes; p++) {
+        const struct remap_plane* plane = &run->plane[p];
+        const uint32_t shift = plane->subsample;
+        struct image_band part;
+
+        part.x      = band->x >> shift;
+        part.y      = band->y >> shift;
+        part.width  = ((band->x + band->width)  >> shift) - part.x;
+        part.height = ((band->y + band->height) >> shift) - part.y;
+        if (part.width && part.height) {
+            remap_band(plane->table, plane, &part);
+        }
+    }
+#ifdef __SSE2__
+    /* Streamed stores of this thread are visible to the consumer */
+    _mm_sfence();
+#endif
+}
+
+/**
+ * Views of one source frame, stacked in one frame of the widest view and
+ * their total height for the pool. Views start on even rows, so chroma
+ * rows split with the luma ones.
+ */
+struct remap_batch {
+    struct remap_run* runs;
+    const uint32_t* tops;
+    unsigned int count;
+};
+
+static void remap_batch_band(void* arg, const struct image_band* const band,
+                             void* scratch)
+{
+    const struct remap_batch* batch = arg;
+
+    for (unsigned int v = 0; v < batch->count; v++) {
+        const struct remap_table* table = batch->runs[v].plane[0].table;
+        const uint32_t top    = batch->tops[v];
+        const uint32_t first  = max(band->y, top);
+        const uint32_t last   = min(band->y + band->height,
+                                    top + table->height);
+        const uint32_t right  = min(band->x + band->width, table->width);
+
+        if (first < last && band->x < right) {
+            struct image_band part = {band->x, first - top,
+                                      right - band->x, last - first};
+            remap_frame_band(&batch->runs[v], &part, scratch);
+        }
+    }
+}
+
+/* Planes of one view */
+static void remap_prepare_run(struct remap_run* run,
+                              const struct remap_table* table,
+                              const uint8_t* src, uint8_t* dst,
+                              const struct image_format* fmt,
+                              const struct image_format* out,
+                              enum interpolation interp)
+{
+    struct remap_plane* plane = &run->plane[0];
+
+    memset(run, 0, sizeof(*run));
+    run->planes    = 1;
+    plane->table   = table;
+    plane->src     = src;
+    plane->sstride = fmt->bytesperline;
+    plane->swidth  = table->src_width;
+    plane->sheight = table->src_height;
+    plane->dst     = dst;
+    plane->dstride = out->bytesperline;
+    plane->bpp     = fmt->pixelformat == PIXEL_YV12 ? 1 :
+                     fmt->bytesperline / fmt->width;
+    plane->step    = 1;
+    plane->shift   = 0;
+    plane->interp  = interp;
+    plane->stream  = (size_t)table->width * table->height * plane->bpp >=
+                     REMAP_STREAM_BYTES;
+#ifdef REMAP_AVX2
+    plane->avx2    = __builtin_cpu_supports("avx2");
+#endif
+
+    if (fmt->pixelformat == PIXEL_YV12) {
+        const uint32_t cstride = fmt->bytesperline >> 1;
+        const size_t   ysize   = (size_t)fmt->bytesperline * fmt->height;
+        const size_t   csize   = (size_t)cstride * (fmt->height >> 1);
+        const uint32_t dcstride = out->bytesperline >> 1;
+        const size_t   dysize   = (size_t)out->bytesperline * out->height;
+        const size_t   dcsize   = (size_t)dcstride * (out->height >> 1);
+
+        /* Chroma follows its own table, or the luma entry of the top left
+         * pixel of each pair */
+        for (unsigned int p = 1; p < 3; p++) {
+            plane = &run->plane[p];
+            *plane = run->plane[0];
+            plane->src     = src + ysize + (p - 1) * csize;
+            plane->sstride = cstride;
+            plane->swidth  = table->src_width  >> 1;
+            plane->sheight = table->src_height >> 1;
+            plane->dst     = dst + dysize + (p - 1) * dcsize;
+            plane->dstride = dcstride;
+            plane->subsample = 1;
+            if (table->chroma) {
+                plane->table = table->chroma;
+            } else {
+                plane->step  = 2;
+                plane->shift = 1;
+            }
+        }
+        run->planes = 3;
+    }
+}
+
+void remap_frames(const struct remap_view* views, unsigned int count,
+                  const uint8_t* src, const struct image_format* fmt,
+                  enum interpolation interp, struct worker_pool* pool)
+{assert(views && count && src && fmt);
+
+    struct remap_run runs[count];
+    uint32_t tops[count];
+    struct remap_batch batch = {runs, tops, count};
+    struct band_job job = {remap_batch_band, &batch, 0, NULL, 0};
+    struct image_format frame = *views[0].out;
+
+    frame.width  = 0;
+    frame.height = 0;
+    for (unsigned int v = 0; v < count; v++) {
+        const struct remap_table* table = views[v].table;
+        const struct image_format* out = views[v].out;
+
+        assert(table && views[v].dst && out);
+        assert(table->src_width == fmt->width &&
+               table->src_height == fmt->height);
+        assert(table->width == out->width && table->height == out->height);
+        assert(fmt->pixelformat == out->pixelformat);
+        assert(!table->sample_shift || fmt->pixelformat != PIXEL_YV12 ||
+               table->chroma);
+
+        remap_prepare_run(&runs[v], table, src, views[v].dst, fmt, out,
+                          interp);
+        tops[v]      = frame.height;
+        frame.width  = max(frame.width, out->width);
+        frame.height = (frame.height + out->height + 1) & ~1U;
+    }
+    if (interp == INTERP_BICUBIC) {
+        pthread_once(&cubic_once, remap_cubic_init);
+    }
+
+    /* Output tiles of every view in parallel, the tuner picks their size */
+    parallel_for_tiles(pool, &frame, &job, 0, 0);
+}
+
+void remap_frame(const struct remap_table* table, const uint8_t* src,
+                 uint8_t* dst, const struct image_format* fmt,
+                 const struct image_format* out, enum interpolation interp,
+                 struct worker_pool* pool)
+{assert(table && dst && out);
+
+    const struct remap_view view = {table, dst, out};
+
+    remap_frames(&view, 1, src, fmt, interp, pool);
+}
+
+/**
+ * Header of a stored table, followed by its entries. The chroma table comes
+ * next as a header and entries of its own.
+ */
+struct remap_file {
+    char magic[8];
+    char key[REMAP_KEY_SIZE];
+    uint32_t width;
+    uint32_t height;
+    uint32_t src_width;
+    uint32_t src_height;
+    uint32_t mesh_shift;
+    uint32_t sample_shift;
+    uint32_t cols;
+    uint32_t rows;
+    /* Non zero when a chroma table follows */
+    uint32_t chroma;
+};
+
+/* Every entry inside the source plane, as the kernels take for granted */
+static bool remap_valid(const struct remap_table* table)
+{
+    const int32_t xmax = (int32_t)(table->src_width  - 1) << REMAP_FRAC_BITS;
+    const int32_t ymax = (int32_t)(table->src_height - 1) << REMAP_FRAC_BITS;
+    const size_t count = (size_t)table->cols * table->rows;
+    bool valid = true;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct remap_coord* coord = &table->coords[i];
+        valid &= coord->x >= 0 && coord->x <= xmax &&
+                 coord->y >= 0 && coord->y <= ymax;
+    }
+    return valid;
+}
+
+/* Table of the header at *offset, the entries stay in the mapping */
+static struct remap_table* remap_map_table(uint8_t* mapping, size_t size,
+                                           size_t* offset, const char* key)
+{
+    struct remap_file head;
+    struct remap_table* table;
+
+    if (size - *offset < sizeof(head)) {
+        return NULL;
+    }
+    memcpy(&head, mapping + *offset, sizeof(head));
+    if (memcmp(head.magic, REMAP_FILE_MAGIC, sizeof(head.magic)) ||
+        strncmp(head.key, key, sizeof(head.key)) ||
+        !head.width || !head.height || !head.src_width ||
+        !head.src_height || head.mesh_shift > 5 ||
+        head.sample_shift > REMAP_MAX_SAMPLE_SHIFT ||
+        head.width > INT16_MAX || head.height > INT16_MAX ||
+        head.src_width > INT16_MAX || head.src_height > INT16_MAX) {
+        return NULL;
+    }
+
+    table = calloc(1, sizeof(*table));
+    if (!table) {
+        fprintf(stderr, "Cannot allocate remap table\n");
+        exit(EXIT_FAILURE);
+    }
+    table->width      = head.width;
+    table->height     = head.height;
+    table->src_width  = head.src_width;
+    table->src_height = head.src_height;
+    table->mesh_shift = head.mesh_shift;
+    table->sample_shift = head.sample_shift;
+    table->refs       = 1;
+    remap_grid(table);
+    *offset += sizeof(head);
+    table->coords  = (struct remap_coord*)(mapping + *offset);
+    table->mapping = mapping;
+    *offset += (size_t)table->cols * table->rows * sizeof(*table->coords);
+
+    if (table->cols != head.cols || table->rows != head.rows ||
+        *offset > size || !remap_valid(table)) {
+        free(table);
+        return NULL;
+    }
+    if (head.chroma) {
+        table->chroma = remap_map_table(mapping, size, offset, key);
+        if (!table->chroma) {
+            free(table);
+            return NULL;
+        }
+    }
+    return table;
+}
+
+struct remap_table* load_remap_table(const char* path, const char* key)
+{assert(path && key);
+
+    struct remap_table* table = NULL;
+    struct stat st;
+    void* mapping;
+    size_t offset = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct remap_file)) {
+        close(fd);
+        return NULL;
+    }
+    /* Pages of the file are shared by every process mapping it */
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    table = remap_map_table(mapping, st.st_size, &offset, key);
+    if (!table) {
+        fprintf(stderr, "Ignoring remap table file %s\n", path);
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    table->mapping_size = st.st_size;
+    return table;
+}
+
+/* Header and entries of one table */
+static bool remap_write_table(FILE* file, const struct remap_table* table,
+                              const char* key)
+{
+    struct remap_file head;
+    const size_t count = (size_t)table->cols * table->rows;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, REMAP_FILE_MAGIC, sizeof(head.magic));
+    strncpy(head.key, key, sizeof(head.key) - 1);
+    head.width      = table->width;
+    head.height     = table->height;
+    head.src_width  = table->src_width;
+    head.src_height = table->src_height;
+    head.mesh_shift = table->mesh_shift;
+    head.sample_shift = table->sample_shift;
+    head.cols       = table->cols;
+    head.rows       = table->rows;
+    head.chroma     = table->chroma != NULL;
+
+    return fwrite(&head, sizeof(head), 1, file) == 1 &&
+           fwrite(table->coords, sizeof(*table->coords), count, file) ==
+           count;
+}
+
+bool store_remap_table(const struct remap_table* table, const char* path,
+                       const char* key)
+{assert(table && path && key && strlen(key) < REMAP_KEY_SIZE);
+
+    char temp[PATH_MAX];
+    FILE* file;
+    bool done;
+    int fd;
+
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >=
+        (int)sizeof(temp)) {
+        return false;
+    }
+    /* Own file of the writer, elements of one process may store the table */
+    fd = mkstemp(temp);
+    if (fd < 0) {
+        return false;
+    }
+    /* Readable by the other processes sharing the tables */
+    file = fchmod(fd, 0644) ? NULL : fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        unlink(temp);
+        return false;
+    }
+
+    done = remap_write_table(file, table, key) &&
+           (!table->chroma || remap_write_table(file, table->chroma, key));
+    done = !fclose(file) && done;
+    /* Readers see the old file or the whole new one */
+    if (!done || rename(temp, path)) {
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
+
+/* Planes of a map file */
+struct remap_maps {
+    const float* x;
+    const float* y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/* Left or top pixel of the pair around pos, the last pair past the edge */
+static inline uint32_t remap_maps_cell(float pos, uint32_t size)
+{
+    const float last = (float)(size > 1 ? size - 2 : 0);
+    const float cell = fminf(fmaxf(floorf(pos), 0.0f), last);
+
+    return (uint32_t)cell;
+}
+
+/**
+ * Map positions at a destination point, bilinear between the pixels for
+ * the chroma and mesh points off them. The mesh points past the last
+ * pixel carry on along the edge pixels.
+ */
+static void remap_maps_point(void* arg, float x, float y, float* sx,
+                             float* sy)
+{
+    const struct remap_maps* maps = arg;
+    const uint32_t x0 = remap_maps_cell(x, maps->width);
+    const uint32_t y0 = remap_maps_cell(y, maps->height);
+    const size_t right = x0 + 1 < maps->width  ? 1 : 0;
+    const size_t below = y0 + 1 < maps->height ? maps->width : 0;
+    const size_t i = (size_t)y0 * maps->width + x0;
+    const float wx = right ? x - (float)x0 : 0.0f;
+    const float wy = below ? y - (float)y0 : 0.0f;
+
+    float top    = maps->x[i] + (maps->x[i + right] - maps->x[i]) * wx;
+    float bottom = maps->x[i + below] +
+                   (maps->x[i + below + right] - maps->x[i + below]) * wx;
+    *sx = top + (bottom - top) * wy;
+
+    top    = maps->y[i] + (maps->y[i + right] - maps->y[i]) * wx;
+    bottom = maps->y[i + below] +
+             (maps->y[i + below + right] - maps->y[i + below]) * wx;
+    *sy = top + (bottom - top) * wy;
+}
+
+struct remap_table* load_remap_maps(const char* path,
+                                    const struct image_format* fmt,
+                                    const struct image_format* out,
+                                    uint32_t mesh_shift,
+                                    struct worker_pool* pool)
+{assert(path && fmt && out);
+
+    const size_t plane = (size_t)out->width * out->height * sizeof(float);
+    struct remap_table* table;
+    struct remap_maps maps;
+    struct stat st;
+    void* mapping;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open map file %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) || (size_t)st.st_size != 2 * plane) {
+        fprintf(stderr, "Ignoring map file %s, not two %ux%u float planes\n",
+                path, out->width, out->height);
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    /* Read once front to back by the table build */
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    maps.x      = mapping;
+    maps.y      = (const float*)((const uint8_t*)mapping + plane);
+    maps.width  = out->width;
+    maps.height = out->height;
+
+    table = prepare_remap_table(out->width, out->height, fmt->width,
+                                fmt->height, mesh_shift, 0);
+    if (fmt->pixelformat == PIXEL_YV12) {
+        prepare_remap_chroma(table);
+    }
+    build_remap_table(table, remap_maps_point, &maps, pool);
+
+    munmap(mapping, st.st_size);
+    return table;
+}
+
+struct remap_table* remap_table_ref(struct remap_table* table)
+{assert(table);
+
+    __atomic_add_fetch(&table->refs, 1, __ATOMIC_RELAXED);
+    return table;
+}
+
+void release_remap_table(struct remap_table* table)
+{
+    if (table && !__atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL)) {
+        release_remap_table(table->chroma);
+        if (!table->mapping) {
+            free(table->coords);
+        } else if (table->mapping_size) {
+            munmap(table->mapping, table->mapping_size);
+        }
+        free(table);
+    }
+}
+
+struct remap_cached {
+    char* key;
+    struct remap_table* table;
+    size_t bytes;
+    /* Cache clock of the last use */
+    uint64_t used;
+};
+
+struct remap_cache {
+    Hashmap* map;
+    size_t limit;
+    size_t bytes;
+    uint64_t clock;
+};
+
+/* Least recently used entry other than the one to keep */
+struct remap_victim {
+    const struct remap_cached* keep;
+    struct remap_cached* oldest;
+};
+
+static unsigned long remap_key_hash(void* key)
+{
+    return djb2_hash(key);
+}
+
+static bool remap_key_equals(void* keyA, void* keyB)
+{
+    return strcmp(keyA, keyB) == 0;
+}
+
+static bool remap_find_victim(void* key, void* value, void* context)
+{
+    struct remap_victim* victim = context;
+    struct remap_cached* cached = value;
+
+    if (cached != victim->keep &&
+        (!victim->oldest || cached->used < victim->oldest->used)) {
+        victim->oldest = cached;
+    }
+    return true;
+}
+
+static void remap_drop(struct remap_cache* cache,
+                       struct remap_cached* cached)
+{
+    hashmapRemove(cache->map, cached->key);
+    cache->bytes -= cached->bytes;
+    release_remap_table(cached->table);
+    free(cached->key);
+    free(cached);
+}
+
+/* Drop the least recently used tables until they fit the limit */
+static void remap_evict(struct remap_cache* cache,
+                        const struct remap_cached* keep)
+{
+    while (cache->bytes > cache->limit) {
+        struct remap_victim victim = {keep, NULL};
+
+        hashmapForEach(cache->map, remap_find_victim, &victim);
+        if (!victim.oldest) {
+            break;
+        }
+        remap_drop(cache, victim.oldest);
+    }
+}
+
+struct remap_cache* prepare_remap_cache(size_t limit)
+{
+    struct remap_cache* cache = calloc(1, sizeof(*cache));
+
+    if (!cache) {
+        fprintf(stderr, "Cannot allocate remap cache\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->map = hashmapCreate(16, remap_key_hash, remap_key_equals);
+    if (!cache->map) {
+        fprintf(stderr, "Cannot allocate remap cache\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->limit = limit;
+
+    return cache;
+}
+
+void remap_cache_limit(struct remap_cache* cache, size_t limit)
+{assert(cache);
+
+    hashmapLock(cache->map);
+    cache->limit = limit;
+    remap_evict(cache, NULL);
+    hashmapUnlock(cache->map);
+}
+
+struct remap_table* remap_cache_get(struct remap_cache* cache,
+                                    const char* key)
+{assert(cache && key);
+
+    struct remap_table* table = NULL;
+
+    hashmapLock(cache->map);
+    struct remap_cached* cached = hashmapGet(cache->map, (void*)key);
+    if (cached) {
+        cached->used = ++cache->clock;
+        table = remap_table_ref(cached->table);
+    }
+    hashmapUnlock(cache->map);
+
+    return table;
+}
+
+void remap_cache_put(struct remap_cache* cache, const char* key,
+                     struct remap_table* table)
+{assert(cache && key && table);
+
+    hashmapLock(cache->map);
+    if (cache->limit) {
+        struct remap_cached* cached = hashmapGet(cache->map, (void*)key);
+        if (cached) {
+            remap_drop(cache, cached);
+        }
+
+        cached = calloc(1, sizeof(*cached));
+        if (!cached || !(cached->key = strdup(key))) {
+            fprintf(stderr, "Cannot allocate remap cache entry\n");
+            exit(EXIT_FAILURE);
+        }
+        cached->table = remap_table_ref(table);
+        cached->bytes = remap_table_size(table);
+        cached->used  = ++cache->clock;
+        /* A new key returns NULL as well, errno tells the failure */
+        errno = 0;
+        if (!hashmapPut(cache->map, cached->key, cached) && errno == ENOMEM) {
+            fprintf(stderr, "Cannot allocate remap cache entry\n");
+            exit(EXIT_FAILURE);
+        }
+        cache->bytes += cached->bytes;
+        /* The new table stays even alone above the limit */
+        remap_evict(cache, cached);
+    }
+    hashmapUnlock(cache->map);
+}
+
+size_t remap_cache_size(struct remap_cache* cache)
+{assert(cache);
+
+    hashmapLock(cache->map);
+    size_t bytes = cache->bytes;
+    hashmapUnlock(cache->map);
+
+    return bytes;
+}
+
+static bool remap_release_cached(void* key, void* value, void* context)
+{
+    struct remap_cached* cached = value;
+
+    release_remap_table(cached->table);
+    free(cached->key);
+    free(cached);
+    return true;
+}
+
+void release_remap_cache(struct remap_cache* cache)
+{
+    if (cache) {
+        hashmapForEach(cache->map, remap_release_cached, NULL);
+        hashmapFree(cache->map);
+        free(cache);
+    }
+}